@@ -2,18 +2,24 @@
 
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 #include <linux/usb.h>
 #include <linux/slab.h>
-#include <linux/vmalloc.h>
 #include <linux/version.h>
 
+#include <sound/control.h>
 #include <sound/core.h>
 #include <sound/initval.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
 #include <sound/rawmidi.h>
 
+#include "eie-stream.h"
+
 MODULE_DESCRIPTION("Akai EIE pro driver");
 MODULE_AUTHOR("Michal Rydlo <michal.rydlo@gmail.com>");
 MODULE_LICENSE("GPL v2");
@@ -22,14 +28,74 @@ static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
 static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP;
 
+static unsigned int start_timeout_ms = 500;
+module_param(start_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(start_timeout_ms, "Time to wait for the device to start streaming (ms).");
+
+static unsigned int watchdog_ms = 100;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms, "Stall detection interval of running streams (ms), 0 = off.");
+
+static bool aggregate;
+module_param(aggregate, bool, 0444);
+MODULE_PARM_DESC(aggregate, "Expose all units as one multichannel playback PCM on the first card.");
+
+static unsigned int locked_rate;
+
+/* a rate the device cannot run at would make every open fail */
+static int locked_rate_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int rate;
+	int err;
+
+	err = kstrtouint(val, 0, &rate);
+	if (err < 0)
+		return err;
+	if (rate != 0 && rate != 44100 && rate != 48000 && rate != 88200
+		&& rate != 96000)
+		return -EINVAL;
+	return param_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops locked_rate_ops = {
+	.set = locked_rate_set,
+	.get = param_get_uint,
+};
+module_param_cb(locked_rate, &locked_rate_ops, &locked_rate, 0644);
+MODULE_PARM_DESC(locked_rate, "Allow only this sampling rate (44100, 48000, 88200 or 96000), 0 = any.");
+
+static bool bh_urbs;
+module_param(bh_urbs, bool, 0444);
+MODULE_PARM_DESC(bh_urbs, "Fill and decode URBs in a high priority work item, not in the USB completion.");
+
+static bool meter_playback;
+module_param(meter_playback, bool, 0644);
+MODULE_PARM_DESC(meter_playback, "Measure the playback levels too (the capture ones are always measured).");
+
+static bool shape_packets;
+module_param(shape_packets, bool, 0644);
+MODULE_PARM_DESC(shape_packets, "Size the playback packets like the device clock consumes the frames.");
+
+static bool early_start;
+module_param(early_start, bool, 0644);
+MODULE_PARM_DESC(early_start, "Start playback in the URBs already queued to the host controller (experimental).");
+
+/* guards only the allocation of card slots in devices_used */
 static DEFINE_MUTEX(devices_mutex);
-static unsigned int devices_used;
+static DECLARE_BITMAP(devices_used, SNDRV_CARDS);
 static struct usb_driver eie_driver;
 
 #define SYNC_URB_CNT 2
 
-#define PLAY_URB_CNT 2
-#define PLAY_PKT_CNT 40
+#define PLAY_PKT_CNT EIE_PLAY_PKT_CNT
+/* shortest playback URB, used with periods below 5 ms */
+#define PLAY_PKT_MIN 8
+/* microframes queued to the host controller, more URBs when they are short */
+#define PLAY_QUEUE_MF 80
+#define PLAY_URBS_IN_FLIGHT_MIN 2
+#define PLAY_URBS_IN_FLIGHT_MAX DIV_ROUND_UP(PLAY_QUEUE_MF, PLAY_PKT_MIN)
+/* the spare URB is filled ahead with bh_urbs */
+#define PLAY_URB_CNT (PLAY_URBS_IN_FLIGHT_MAX + 1)
 
 #define CAP_URB_CNT 2
 
@@ -39,19 +105,128 @@ static struct usb_driver eie_driver;
 #define BYTES_PER_FRAME 12
 #define BYTES_PER_FRAME_CAP 16
 
+/*
+ * The PCM buffers are preallocated once per substream for the longest
+ * buffer allowed at the highest rate, so hw_params never allocates. Only
+ * the CPU copies them to the URBs, so they are vmalloc'ed rather than
+ * physically contiguous. The loopback and the raw capture are allocated by
+ * hw_params instead.
+ */
+#define MAX_BUFFER_MS 500
+#define MAX_BUFFER_FRAMES (96000 * MAX_BUFFER_MS / 1000)
+#define PLAY_BUFFER_BYTES_MAX (MAX_BUFFER_FRAMES * BYTES_PER_FRAME)
+/* S24_LE and S32_LE playback, packed to BYTES_PER_FRAME on the URB fill */
+#define BYTES_PER_FRAME_32 16
+#define PLAY_BUFFER_BYTES_MAX_32 (MAX_BUFFER_FRAMES * BYTES_PER_FRAME_32)
+#define CAP_BUFFER_BYTES_MAX (MAX_BUFFER_FRAMES * BYTES_PER_FRAME_CAP)
+#define RAW_BUFFER_BYTES_MAX (MAX_BUFFER_FRAMES * EIE_CAP_FRAME_BYTES)
+
+/* units in the aggregate PCM, 4 channels each */
+#define AGGR_MAX_UNITS 4
+
+/* consecutive clock microframes without progress tolerated as a glitch */
+#define CLOCK_GLITCH_LIMIT 8
+/* consecutive failed capture transfers resubmitted before a restart */
+#define CAP_ERROR_LIMIT 8
+/* URB restarts allowed per RESTART_WINDOW_MS before a full device reset */
+#define RESTART_LIMIT 3
+#define RESTART_WINDOW_MS 1000
+
+/* captured frames buffered for the direct monitor, a power of 2 */
+#define MON_RING_FRAMES 1024
+/* the monitor drops frames when it lags behind the capture more than this */
+#define MON_MAX_LAG 64
+/* monitor gain of 1.0 */
+#define MON_GAIN_UNITY 256
+
+/*
+ * The frames the device consumes per microframe repeat every 80 microframes
+ * at all rates: 441 frames in 80 at 44.1 kHz, 441 in 40 at 88.2 kHz and the
+ * same count in each at 48 and 96 kHz.
+ */
+#define CLOCK_PATTERN 80
+/* clock microframes kept for shaping the playback packets, a power of 2 */
+#define CLOCK_HIST 128
+
+/*
+ * Microframes the host controller may have fetched ahead of the one being
+ * sent, a started stream is patched into the queued URBs after them. The
+ * xHCI isochronous scheduling threshold is at most 8 frames.
+ */
+#define START_LEAD_MF 64
+
+/* URBs processed by one run of the URB work before it yields */
+#define URB_WORK_BUDGET 4
+
+/* URB completions kept by the flight recorder, a power of 2 */
+#define FLIGHT_ENTRIES 256
+
 /*
  * TODO: redefine states & respect the close command again
- * TODO: fix opening of the 2nd stream to be limited to the rate of the 1st
- * TODO: correctly handle xruns
  */
 
 enum {
 	PLAYBACK_RUNNING,
 	CAPTURE_RUNNING,
 	URBS_FLOWING,
-	DISCONNECTED, /* TODO use */
+	DISCONNECTED,
 	MIN_OPEN,
-	MIN_UP
+	MIN_UP,
+	RECOVERING,
+	SUSPENDED,
+	AGGR_OPEN,
+	LOOPBACK_RUNNING,
+	CAPTURE_URBS,
+	RAW_RUNNING
+};
+
+/*
+ * Levels accumulated over the current period, published to last_peak and
+ * last_rms for the level controls when it elapses. Squares are summed from
+ * the top 16 bits of the samples so the sum does not overflow.
+ */
+struct eie_meter {
+	u32 peak[4];
+	u64 sum_sq[4];
+	u32 frames;
+	u32 last_peak[4];
+	u32 last_rms[4];
+};
+
+/* substreams in eie::stream_rate, the first two are the ALSA directions */
+enum {
+	SLOT_PLAYBACK,
+	SLOT_CAPTURE,
+	SLOT_LOOPBACK,
+	SLOT_RAW,
+	SLOT_CNT
+};
+
+enum {
+	FLIGHT_SYNC,
+	FLIGHT_PLAY,
+	FLIGHT_CAP
+};
+
+struct eie_flight_entry {
+	ktime_t time;
+	s32 status;
+	u16 frames; /* clock frames, frames filled or frames received */
+	u8 kind;
+	u8 aux; /* packets of the sync or playback URB, capture bytes left */
+};
+
+/*
+ * The last URB completions, written without locks from any completion and
+ * frozen by the first xrun or abort until debugfs is written to. Entries
+ * being written at the moment of the freeze may show up half updated.
+ */
+struct eie_flight {
+	atomic_t head; /**< free running */
+	atomic_t frozen;
+	const char *reason;
+	ktime_t frozen_at;
+	struct eie_flight_entry entries[FLIGHT_ENTRIES];
 };
 
 struct eie_playback_urb {
@@ -59,6 +234,13 @@ struct eie_playback_urb {
 	struct urb *urb;
 	bool silent;
 	unsigned int len; /* in frames */
+	unsigned int queued; /* frames sent to the device, audio or silence */
+	unsigned int layout_frames; /* of the iso descriptors, 0 = unset */
+	unsigned int layout_pkts;
+	u64 first; /* play_sent at the first frame */
+	bool in_flight;
+	bool looped; /* copied to the loopback at loop_wr */
+	unsigned int loop_wr;
 };
 
 struct eie {
@@ -72,6 +254,13 @@ struct eie {
 	struct snd_pcm *pcm;
 
 	unsigned int rate;
+	unsigned int suspended_rate; /**< rate to restore on resume */
+	/*
+	 * rate and period size of each prepared substream, 0 = none,
+	 * indexed by substream_slot()
+	 */
+	unsigned int stream_rate[SLOT_CNT];
+	unsigned int stream_period[SLOT_CNT];
 
 	__u8 sync_endpoint_addr;
 	size_t sync_packet_size;
@@ -85,17 +274,86 @@ struct eie {
 	wait_queue_head_t urbs_flow_wait;
 
 	unsigned int play_buf_pos;
-	unsigned int played_frames;
-	unsigned char wanted_idx;
+	unsigned int play_frame_bytes; /**< of the ALSA buffer */
+	unsigned int play_shift; /**< of the samples in 32-bit words */
+	unsigned int played_frames; /**< since the last period boundary */
+	unsigned int wanted_rem;
+	unsigned int play_pkts; /**< packets per playback URB, at most a period */
+	unsigned int play_urbs_wanted; /**< in flight for play_pkts */
+	unsigned int play_in_flight; /**< playback URBs submitted */
+	struct eie_layout_table layouts; /**< for rate and play_pkts */
+	unsigned int play_queued; /**< frames in the in-flight playback URBs */
+	struct eie_playback_urb *play_spare; /**< the URB not in flight */
+	bool play_spare_filled;
+	u64 play_sent; /**< frames filled since the URBs were started */
+	bool play_start_pending; /**< started, first frame not sent yet */
+	u64 play_trigger_pos; /**< frame being sent at the last start */
+	u64 play_start; /**< frame the last start began at */
 
 	__u8 cap_endpoint_addr;
 	struct urb *cap_urbs[CAP_URB_CNT];
 	struct snd_pcm_substream *cap_substream;
 	unsigned int cap_buf_pos;
 	unsigned int cap_frames;
+	unsigned int cap_skip; /**< frames to drop to align with playback */
+	unsigned int link_offset; /**< cap_skip of the last linked start */
+	unsigned long cap_pending; /**< completed capture URBs to decode */
+	unsigned long cap_failed; /**< of those, the ones without data */
+	unsigned int cap_errors; /**< consecutive failed transfers */
+	unsigned long cap_lost; /**< not resubmitted, with CAPTURE_URBS set */
+	unsigned int cap_next; /**< the pending URB to decode first */
+	u8 cap_carry[EIE_CAP_FRAME_BYTES]; /**< frame split between transfers */
+	unsigned int cap_carry_len;
+	unsigned int cap_carried; /**< transfers that ended inside a frame */
+	unsigned int cap_realigns; /**< carry dropped after lost data */
+	struct mutex cap_mutex; /**< serializes starting and killing cap_urbs */
+
+	/* playback loopback, guarded by lock */
+	struct snd_pcm_substream *loop_substream;
+	unsigned int loop_buf_pos; /**< frames played by the device */
+	unsigned int loop_wr; /**< frames sent to the device */
+	unsigned int loop_frames; /**< since the last period boundary */
+	u64 loop_written; /**< frames sent since the start */
+	u64 loop_reported; /**< of those, frames played */
+	s64 loop_played; /**< device frames since the start */
+
+	/* undecoded capture, guarded by lock */
+	struct snd_pcm_substream *raw_substream;
+	unsigned int raw_buf_pos;
+	unsigned int raw_frames; /**< since the last period boundary */
+
+	struct eie_meter play_meter; /**< guarded by lock */
+	struct eie_meter cap_meter;
+
+	/* direct monitor, guarded by lock */
+	bool mon_enabled;
+	unsigned int mon_gain[4];
+	unsigned int mon_wr; /**< free running positions in mon_ring */
+	unsigned int mon_rd;
+	s32 mon_ring[MON_RING_FRAMES][4];
+
+	/* with bh_urbs, the fill and decode of the URBs happen here */
+	struct work_struct urb_work;
+	unsigned int urb_work_misses; /**< spare URB not filled in time */
 
 	atomic_t frames_elapsed; /**< frames elapsed as reported by EIE */
 
+	struct hrtimer watchdog;
+	struct work_struct recovery_work;
+	struct mutex reset_mutex; /**< serializes resets and the recovery */
+	ktime_t sync_active; /**< last completion of each stream, 0 = not yet */
+	ktime_t play_active;
+	ktime_t cap_active;
+	unsigned int clock_glitches; /**< consecutive clock bytes of 0 */
+	u8 clock_hist[CLOCK_HIST]; /**< frames consumed in each microframe */
+	unsigned int clock_hist_pos; /**< free running, 0 at the stream start */
+	unsigned int clock_missed; /**< sync packets lost since the last one */
+	unsigned int restarts; /**< URB restarts in the current window */
+	unsigned long restart_window; /**< jiffies when the window started */
+
+	struct eie_flight flight;
+	struct dentry *debugfs;
+
 	spinlock_t lock; /**< used for TODO */
 
 	unsigned long states;
@@ -108,9 +366,71 @@ struct eie {
 	unsigned long submitted_mout_urbs;
 	struct snd_rawmidi_substream *min_substream;
 	struct snd_rawmidi_substream *mout_substream;
+
+	/* the following are guarded by eie_aggr.lock */
+	bool aggr_member;
+	unsigned int aggr_slot; /**< index of the unit's channels */
+	bool aggr_running;
+	u64 aggr_read; /**< frames read from the aggregate buffer */
+	atomic64_t aggr_clock; /**< device frames since the aggregate start */
+	s64 aggr_drift; /**< filtered clock lead over the master, 1/256 frames */
+	int aggr_slip; /**< frames repeated (+) or dropped (-) so far */
+	struct snd_pcm_substream *aggr_elapsed;
+};
+
+/*
+ * Several units can be driven as one PCM. Each unit sends its 4 channels of
+ * the aggregate buffer paced by its own clock; units[0] is the master whose
+ * clock defines the stream. The others follow the master by repeating or
+ * dropping a single frame whenever their clock lead changes by a frame.
+ *
+ * Lock order: PCM stream lock or eie->lock, then eie_aggr.lock.
+ */
+struct eie_aggr {
+	struct mutex mutex; /**< guards membership and open/prepare/close */
+	spinlock_t lock;
+	struct eie *units[AGGR_MAX_UNITS];
+	unsigned int active; /**< units taking part in the open stream */
+	struct snd_pcm_substream *substream;
+	unsigned int period_frames;
+};
+
+static struct eie_aggr eie_aggr = {
+	.mutex = __MUTEX_INITIALIZER(eie_aggr.mutex),
+	.lock = __SPIN_LOCK_UNLOCKED(eie_aggr.lock),
 };
 
 static struct snd_pcm_hardware eie_playback_hw = {
+	.info = (SNDRV_PCM_INFO_MMAP |
+		SNDRV_PCM_INFO_MMAP_VALID |
+		SNDRV_PCM_INFO_BATCH |
+		SNDRV_PCM_INFO_INTERLEAVED |
+		SNDRV_PCM_INFO_BLOCK_TRANSFER |
+		SNDRV_PCM_INFO_FIFO_IN_FRAMES |
+		SNDRV_PCM_INFO_SYNC_START |
+		SNDRV_PCM_INFO_JOINT_DUPLEX |
+		SNDRV_PCM_INFO_PAUSE |
+		SNDRV_PCM_INFO_RESUME),
+	.formats = (SNDRV_PCM_FMTBIT_S24_3LE |
+		SNDRV_PCM_FMTBIT_S24_LE |
+		SNDRV_PCM_FMTBIT_S32_LE),
+	.rates = (SNDRV_PCM_RATE_44100 |
+		SNDRV_PCM_RATE_48000 |
+		SNDRV_PCM_RATE_88200 |
+		SNDRV_PCM_RATE_96000),
+	.rate_min = 44100,
+	.rate_max = 96000,
+	.channels_min = 4,
+	.channels_max = 4,
+	.buffer_bytes_max = PLAY_BUFFER_BYTES_MAX_32,
+	.period_bytes_min = 64*BYTES_PER_FRAME,
+	.period_bytes_max = PLAY_BUFFER_BYTES_MAX_32 / 2,
+	.periods_min = 2,
+	.periods_max = UINT_MAX,
+};
+
+/* one unit after another, 4 channels each */
+static struct snd_pcm_hardware eie_aggregate_hw = {
 	.info = (SNDRV_PCM_INFO_MMAP |
 		SNDRV_PCM_INFO_MMAP_VALID |
 		SNDRV_PCM_INFO_BATCH |
@@ -125,16 +445,102 @@ static struct snd_pcm_hardware eie_playback_hw = {
 	.rate_min = 44100,
 	.rate_max = 96000,
 	.channels_min = 4,
+	.channels_max = 4 * AGGR_MAX_UNITS,
+	.buffer_bytes_max = PLAY_BUFFER_BYTES_MAX * AGGR_MAX_UNITS,
+	.period_bytes_min = 64*BYTES_PER_FRAME,
+	.period_bytes_max = PLAY_BUFFER_BYTES_MAX * AGGR_MAX_UNITS / 2,
+	.periods_min = 2,
+	.periods_max = UINT_MAX,
+};
+
+/* the capture decoder writes each 24-bit sample into 32 bits */
+static struct snd_pcm_hardware eie_capture_hw = {
+	.info = (SNDRV_PCM_INFO_MMAP |
+		SNDRV_PCM_INFO_MMAP_VALID |
+		SNDRV_PCM_INFO_BATCH |
+		SNDRV_PCM_INFO_INTERLEAVED |
+		SNDRV_PCM_INFO_BLOCK_TRANSFER |
+		SNDRV_PCM_INFO_FIFO_IN_FRAMES |
+		SNDRV_PCM_INFO_SYNC_START |
+		SNDRV_PCM_INFO_JOINT_DUPLEX |
+		SNDRV_PCM_INFO_PAUSE |
+		SNDRV_PCM_INFO_RESUME),
+	.formats = SNDRV_PCM_FMTBIT_S24_LE,
+	.rates = (SNDRV_PCM_RATE_44100 |
+		SNDRV_PCM_RATE_48000 |
+		SNDRV_PCM_RATE_88200 |
+		SNDRV_PCM_RATE_96000),
+	.rate_min = 44100,
+	.rate_max = 96000,
+	.channels_min = 4,
+	.channels_max = 4,
+	.buffer_bytes_max = CAP_BUFFER_BYTES_MAX,
+	.period_bytes_min = 64*BYTES_PER_FRAME_CAP,
+	.period_bytes_max = CAP_BUFFER_BYTES_MAX / 2,
+	.periods_min = 2,
+	.periods_max = UINT_MAX,
+};
+
+/*
+ * The captured frames as they come from the device, 2 bits of each of the
+ * 4 channels in the 64 bytes, for decoding in userspace.
+ */
+static struct snd_pcm_hardware eie_raw_hw = {
+	.info = (SNDRV_PCM_INFO_MMAP |
+		SNDRV_PCM_INFO_MMAP_VALID |
+		SNDRV_PCM_INFO_BATCH |
+		SNDRV_PCM_INFO_INTERLEAVED |
+		SNDRV_PCM_INFO_BLOCK_TRANSFER |
+		SNDRV_PCM_INFO_FIFO_IN_FRAMES |
+		SNDRV_PCM_INFO_PAUSE |
+		SNDRV_PCM_INFO_RESUME),
+	.formats = SNDRV_PCM_FMTBIT_U8,
+	.rates = (SNDRV_PCM_RATE_44100 |
+		SNDRV_PCM_RATE_48000 |
+		SNDRV_PCM_RATE_88200 |
+		SNDRV_PCM_RATE_96000),
+	.rate_min = 44100,
+	.rate_max = 96000,
+	.channels_min = EIE_CAP_FRAME_BYTES,
+	.channels_max = EIE_CAP_FRAME_BYTES,
+	.buffer_bytes_max = RAW_BUFFER_BYTES_MAX,
+	.period_bytes_min = 64*EIE_CAP_FRAME_BYTES,
+	.period_bytes_max = RAW_BUFFER_BYTES_MAX / 2,
+	.periods_min = 2,
+	.periods_max = UINT_MAX,
+};
+
+/* the frames sent to the device, in the playback format */
+static struct snd_pcm_hardware eie_loopback_hw = {
+	.info = (SNDRV_PCM_INFO_MMAP |
+		SNDRV_PCM_INFO_MMAP_VALID |
+		SNDRV_PCM_INFO_BATCH |
+		SNDRV_PCM_INFO_INTERLEAVED |
+		SNDRV_PCM_INFO_BLOCK_TRANSFER |
+		SNDRV_PCM_INFO_FIFO_IN_FRAMES |
+		SNDRV_PCM_INFO_PAUSE |
+		SNDRV_PCM_INFO_RESUME),
+	.formats = SNDRV_PCM_FMTBIT_S24_3LE,
+	.rates = (SNDRV_PCM_RATE_44100 |
+		SNDRV_PCM_RATE_48000 |
+		SNDRV_PCM_RATE_88200 |
+		SNDRV_PCM_RATE_96000),
+	.rate_min = 44100,
+	.rate_max = 96000,
+	.channels_min = 4,
 	.channels_max = 4,
-	.buffer_bytes_max = 45000 * 1024, /* TODO: clarify, copied from ua101 */
+	.buffer_bytes_max = PLAY_BUFFER_BYTES_MAX,
 	.period_bytes_min = 64*BYTES_PER_FRAME,
-	.period_bytes_max = UINT_MAX,
+	.period_bytes_max = PLAY_BUFFER_BYTES_MAX / 2,
 	.periods_min = 2,
 	.periods_max = UINT_MAX,
 };
 
 static void kill_all_urbs(struct eie *eie);
 static int submit_init_play_urbs(struct eie *eie);
+static int submit_cap_urbs(struct eie *eie);
+static int update_capture_urbs(struct eie *eie);
+static void start_watchdog(struct eie *eie);
 
 static int eie_set_alt_setting(struct eie *eie)
 {
@@ -146,15 +552,102 @@ static int eie_set_alt_setting(struct eie *eie)
 	return err;
 }
 
+static int refine_single(struct snd_pcm_hw_params *params, int var,
+	unsigned int value)
+{
+	struct snd_interval t = {
+		.min = value,
+		.max = value,
+		.integer = 1,
+	};
+
+	return snd_interval_refine(hw_param_interval(params, var), &t);
+}
+
+static unsigned int substream_slot(struct snd_pcm_substream *substream)
+{
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return SLOT_PLAYBACK;
+	return SLOT_CAPTURE + substream->number;
+}
+
+/* All substreams share the device clock, any prepared one sets the rate. */
+static int eie_hw_rule_rate(struct snd_pcm_hw_params *params,
+	struct snd_pcm_hw_rule *rule)
+{
+	struct snd_pcm_substream *substream = rule->private;
+	struct eie *eie = substream->private_data;
+	unsigned int self = substream_slot(substream);
+	unsigned int rate = 0;
+	unsigned int i;
+
+	for (i = 0; i < SLOT_CNT && rate == 0; i++)
+		if (i != self)
+			rate = READ_ONCE(eie->stream_rate[i]);
+	if (rate == 0)
+		rate = READ_ONCE(locked_rate);
+	if (rate == 0)
+		return 0;
+	return refine_single(params, SNDRV_PCM_HW_PARAM_RATE, rate);
+}
+
+/* keeps the periods of both directions elapsing together */
+static int eie_hw_rule_period(struct snd_pcm_hw_params *params,
+	struct snd_pcm_hw_rule *rule)
+{
+	struct snd_pcm_substream *substream = rule->private;
+	struct eie *eie = substream->private_data;
+	unsigned int period = READ_ONCE(eie->stream_period[!substream->stream]);
+
+	if (period == 0)
+		return 0;
+	return refine_single(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, period);
+}
+
 static int eie_prepare_hw(struct snd_pcm_substream *substream)
 {
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	bool loopback = substream->stream == SNDRV_PCM_STREAM_CAPTURE
+		&& substream->number == 1;
+	bool raw = substream->stream == SNDRV_PCM_STREAM_CAPTURE
+		&& substream->number == 2;
 	int err;
 
-	/* TODO: determine possible HW params from runnnig streams. */
-	substream->runtime->hw = eie_playback_hw;
-	err = snd_pcm_hw_constraint_minmax(substream->runtime,
-		SNDRV_PCM_HW_PARAM_BUFFER_TIME, 10*1000, UINT_MAX);
-	return err;
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		runtime->hw = eie_playback_hw;
+	else if (loopback)
+		runtime->hw = eie_loopback_hw;
+	else if (raw)
+		runtime->hw = eie_raw_hw;
+	else
+		runtime->hw = eie_capture_hw;
+	err = snd_pcm_hw_constraint_minmax(runtime,
+		SNDRV_PCM_HW_PARAM_BUFFER_TIME, 10*1000, MAX_BUFFER_MS*1000);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
+		eie_hw_rule_rate, substream, SNDRV_PCM_HW_PARAM_RATE, -1);
+	if (err < 0)
+		return err;
+	/* these follow the device clock on their own, any period does */
+	if (loopback || raw)
+		return 0;
+	return snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+		eie_hw_rule_period, substream,
+		SNDRV_PCM_HW_PARAM_PERIOD_SIZE, -1);
+}
+
+/* URBs shorter than a period, so every period is reported on time */
+static void set_play_pkts(struct eie *eie, unsigned int pkts)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&eie->lock, flags);
+	eie->play_pkts = clamp_t(unsigned int, pkts, PLAY_PKT_MIN, PLAY_PKT_CNT);
+	eie->play_urbs_wanted = max_t(unsigned int, PLAY_URBS_IN_FLIGHT_MIN,
+		DIV_ROUND_UP(PLAY_QUEUE_MF, eie->play_pkts));
+	eie_layout_table_init(&eie->layouts, eie->rate, eie->play_pkts);
+	spin_unlock_irqrestore(&eie->lock, flags);
 }
 
 static int eie_ppcm_open(struct snd_pcm_substream *substream)
@@ -162,11 +655,23 @@ static int eie_ppcm_open(struct snd_pcm_substream *substream)
 	struct eie *eie = substream->private_data;
 	int err;
 
+	/* eie_apcm_open() checks play_substream under the same mutex */
+	mutex_lock(&eie_aggr.mutex);
+	if (test_bit(AGGR_OPEN, &eie->states)) {
+		err = -EBUSY;
+		goto out;
+	}
+
 	err = eie_prepare_hw(substream);
 	if (err < 0)
-		return err;
+		goto out;
+	err = usb_autopm_get_interface(eie->ifa);
+	if (err < 0)
+		goto out;
 	eie->play_substream = substream;
-	return 0;
+out:
+	mutex_unlock(&eie_aggr.mutex);
+	return err;
 }
 
 static int eie_cpcm_open(struct snd_pcm_substream *substream)
@@ -175,6 +680,9 @@ static int eie_cpcm_open(struct snd_pcm_substream *substream)
 	int err;
 
 	err = eie_prepare_hw(substream);
+	if (err < 0)
+		return err;
+	err = usb_autopm_get_interface(eie->ifa);
 	if (err < 0)
 		return err;
 	eie->cap_substream = substream;
@@ -186,6 +694,10 @@ static int eie_ppcm_close(struct snd_pcm_substream *substream)
 	struct eie *eie = substream->private_data;
 
 	eie->play_substream = NULL;
+	set_play_pkts(eie, PLAY_PKT_CNT);
+	WRITE_ONCE(eie->stream_rate[SNDRV_PCM_STREAM_PLAYBACK], 0);
+	WRITE_ONCE(eie->stream_period[SNDRV_PCM_STREAM_PLAYBACK], 0);
+	usb_autopm_put_interface(eie->ifa);
 
 	return 0;
 }
@@ -194,54 +706,15 @@ static int eie_cpcm_close(struct snd_pcm_substream *substream)
 {
 	struct eie *eie = substream->private_data;
 
+	WRITE_ONCE(eie->stream_rate[SNDRV_PCM_STREAM_CAPTURE], 0);
+	WRITE_ONCE(eie->stream_period[SNDRV_PCM_STREAM_CAPTURE], 0);
+	update_capture_urbs(eie);
 	eie->cap_substream = NULL;
+	usb_autopm_put_interface(eie->ifa);
 
 	return 0;
 }
 
-static int eie_pcm_hw_params(struct snd_pcm_substream *substream,
-	struct snd_pcm_hw_params *hw_params)
-{
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
-	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
-		params_buffer_bytes(hw_params));
-#else
-	struct snd_pcm_runtime *runtime = substream->runtime;
-	size_t size = params_buffer_bytes(hw_params);
-
-	/* Allocate the PCM runtime buffer, which is exposed to userspace. */
-	if (runtime->dma_area) {
-		if (runtime->dma_bytes >= size)
-			return 0; /* already large enough */
-		vfree(runtime->dma_area);
-	}
-	runtime->dma_area = vzalloc(size);
-	if (!runtime->dma_area)
-		return -ENOMEM;
-	runtime->dma_bytes = size;
-	return 1;
-#endif
-}
-
-static int eie_pcm_hw_free(struct snd_pcm_substream *substream)
-{
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
-	return snd_pcm_lib_free_vmalloc_buffer(substream);
-#else
-	struct snd_pcm_runtime *runtime = substream->runtime;
-
-	vfree(runtime->dma_area);
-	runtime->dma_area = NULL;
-	return 0;
-}
-
-static struct page *eie_get_page(struct snd_pcm_substream *substream,
-	unsigned long offset)
-{
-	return vmalloc_to_page(substream->runtime->dma_area + offset);
-}
-#endif
-
 static const char *usb_error_string(int err)
 {
 	switch (err) {
@@ -343,11 +816,51 @@ static int send_magic_sequence(struct eie *eie, struct magic_seq *m, char *data)
 	return 0;
 }
 
+/*
+ * Submits the clock and playback URBs and waits until they flow, then the
+ * capture URBs if they are wanted.
+ */
+static int start_streams(struct eie *eie)
+{
+	long ret;
+	int err;
+
+	err = submit_init_sync_urbs(eie);
+	if (err < 0)
+		goto err;
+
+	err = submit_init_play_urbs(eie);
+	if (err < 0)
+		goto err;
+
+	ret = wait_event_interruptible_timeout(eie->urbs_flow_wait,
+		test_bit(URBS_FLOWING, &eie->states)
+		|| test_bit(DISCONNECTED, &eie->states),
+		msecs_to_jiffies(start_timeout_ms));
+	if (ret > 0 && !test_bit(DISCONNECTED, &eie->states)) {
+		err = submit_cap_urbs(eie);
+		if (err < 0)
+			goto err;
+		start_watchdog(eie);
+		return 0;
+	}
+
+	if (ret == 0)
+		dev_err(&eie->udev->dev, "Device did not start streaming.");
+	err = ret < 0 ? ret : (ret == 0 ? -ETIMEDOUT : -ENODEV);
+err:
+	kill_all_urbs(eie);
+	return err;
+}
+
+/* Called with reset_mutex held. */
 static int reset_eie(struct eie *eie, unsigned int rate)
 {
 	int err = 0;
 	unsigned char *data;
 
+	lockdep_assert_held(&eie->reset_mutex);
+
 	data = kmalloc(MAX_MAGIC_SEQ_LENGTH, GFP_KERNEL);
 	if (!data)
 		return -ENOMEM;
@@ -372,49 +885,106 @@ static int reset_eie(struct eie *eie, unsigned int rate)
 
 	dev_dbg(&eie->udev->dev, "Completed magic initialization sequence.");
 
+	spin_lock_irq(&eie->lock);
 	eie->rate = rate;
+	eie_layout_table_init(&eie->layouts, rate, eie->play_pkts);
+	spin_unlock_irq(&eie->lock);
 
-	err = submit_init_sync_urbs(eie);
+	err = start_streams(eie);
 	if (err < 0)
-		goto out;
+		eie->rate = 0;
 
-	err = submit_init_play_urbs(eie);
-	if (err < 0)
-		goto out;
+out:
+	kfree(data);
+	return err;
+}
+
+/*
+ * Switches the device to the rate. The rate can change only while no
+ * substream runs and no other substream is prepared, the substream in slot
+ * may be prepared again with a new rate.
+ */
+static int set_device_rate(struct eie *eie, unsigned int rate,
+	unsigned int slot)
+{
+	unsigned long busy = BIT(PLAYBACK_RUNNING) | BIT(CAPTURE_RUNNING)
+		| BIT(LOOPBACK_RUNNING) | BIT(RAW_RUNNING);
+	bool prepared = false;
+	unsigned int i;
+	int err = 0;
 
-	wait_event(eie->urbs_flow_wait, test_bit(URBS_FLOWING, &eie->states));
+	mutex_lock(&eie->reset_mutex);
+	if (test_bit(DISCONNECTED, &eie->states)) {
+		err = -ENODEV;
+		goto out;
+	}
+	if (rate == eie->rate)
+		goto out;
 
+	for (i = 0; i < SLOT_CNT; i++)
+		if (i != slot && READ_ONCE(eie->stream_rate[i]))
+			prepared = true;
+	if (prepared || (READ_ONCE(eie->states) & busy)) {
+		dev_err(&eie->udev->dev, "Cannot set rate %u, running at %u.",
+			rate, eie->rate);
+		err = -EBUSY;
+		goto out;
+	}
+	err = reset_eie(eie, rate);
 out:
-	kfree(data);
+	mutex_unlock(&eie->reset_mutex);
 	return err;
 }
 
+static int set_stream_rate(struct snd_pcm_substream *substream, struct eie *eie)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int err;
+
+	err = set_device_rate(eie, runtime->rate, substream_slot(substream));
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(eie->stream_rate[substream_slot(substream)], runtime->rate);
+	WRITE_ONCE(eie->stream_period[substream_slot(substream)],
+		runtime->period_size);
+	return 0;
+}
+
 static int eie_ppcm_prepare(struct snd_pcm_substream *substream)
 {
-	int err = 0;
+	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct eie *eie = substream->private_data;
+	int err;
 
-	if (substream->runtime->rate != eie->rate)
-		err = reset_eie(eie, substream->runtime->rate);
+	set_play_pkts(eie, runtime->period_size * EIE_PKT_RATE / runtime->rate);
+	err = set_stream_rate(substream, eie);
+
+	eie->play_frame_bytes = frames_to_bytes(runtime, 1);
+	eie->play_shift = runtime->format == SNDRV_PCM_FORMAT_S32_LE ? 8 : 0;
 
 	eie->played_frames = 0;
 	eie->play_buf_pos = 0;
 	substream->runtime->delay = 0;
+	memset(&eie->play_meter, 0, sizeof(eie->play_meter));
 
 	return err;
 }
 
 static int eie_cpcm_prepare(struct snd_pcm_substream *substream)
 {
-	int err = 0;
 	struct eie *eie = substream->private_data;
+	int err;
 
-	if (substream->runtime->rate != eie->rate)
-		err = reset_eie(eie, substream->runtime->rate);
+	err = set_stream_rate(substream, eie);
+	if (err == 0)
+		err = update_capture_urbs(eie);
 
 	eie->cap_frames = 0;
 	eie->cap_buf_pos = 0;
+	eie->cap_skip = 0;
 	substream->runtime->delay = 0; // TODO
+	memset(&eie->cap_meter, 0, sizeof(eie->cap_meter));
 
 	return err;
 }
@@ -422,93 +992,459 @@ static int eie_cpcm_prepare(struct snd_pcm_substream *substream)
 
 static unsigned int calc_frames_wanted(struct eie *eie)
 {
-	eie->wanted_idx = 1 - eie->wanted_idx;
-	if (eie->rate == 44100)
-		return 220 + eie->wanted_idx;
-	else
-		return 5 * eie->rate / 1000;
+	return eie_frames_nominal(eie->rate, eie->play_pkts, &eie->wanted_rem);
 }
 
-/** Returns the number of filled frames or negative val for error */
-static __must_check int fill_playback_urb(struct eie_playback_urb *epu)
+/* sample is the 24-bit two's complement value in the low bits */
+static inline void meter_sample(struct eie_meter *m, unsigned int ch, u32 sample)
+{
+	s32 v = eie_sample_s32(sample);
+	u32 a = abs(v);
+	s32 top = v >> 8;
+
+	if (a > m->peak[ch])
+		m->peak[ch] = a;
+	m->sum_sq[ch] += top * top;
+}
+
+static void meter_playback_frames(struct eie_meter *m, const unsigned char *buf,
+	unsigned int frames)
+{
+	unsigned int i, ch;
+
+	for (i = 0; i < frames; i++) {
+		for (ch = 0; ch < 4; ch++, buf += 3)
+			meter_sample(m, ch, buf[0] | buf[1] << 8 | buf[2] << 16);
+	}
+	m->frames += frames;
+}
+
+/* Publishes the levels of the period that elapsed and starts the next one. */
+static void meter_publish(struct eie_meter *m)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < 4; ch++) {
+		/* full scale negative samples give 0x800000 for both */
+		m->last_peak[ch] = min_t(u32, m->peak[ch], 0x7fffff);
+		m->last_rms[ch] = m->frames ? min_t(u32, 0x7fffff,
+			int_sqrt(div_u64(m->sum_sq[ch], m->frames)) << 8) : 0;
+		m->peak[ch] = 0;
+		m->sum_sq[ch] = 0;
+	}
+	m->frames = 0;
+}
+
+static inline void monitor_put(struct eie *eie, const u32 ch[4])
+{
+	s32 *f = eie->mon_ring[eie->mon_wr++ % MON_RING_FRAMES];
+
+	f[0] = eie_sample_s32(ch[0]);
+	f[1] = eie_sample_s32(ch[1]);
+	f[2] = eie_sample_s32(ch[2]);
+	f[3] = eie_sample_s32(ch[3]);
+}
+
+/*
+ * Mixes the latest captured frames into the playback URB. When the capture
+ * does not keep up, the missing frames are left out; when the monitor lags
+ * behind, it jumps ahead so the latency stays bounded.
+ */
+static void monitor_mix(struct eie *eie, unsigned char *buf,
+	unsigned int frames)
+{
+	unsigned int avail = eie->mon_wr - eie->mon_rd;
+	unsigned int i, ch;
+	s32 *f;
+	s32 v;
+
+	if (avail > MON_RING_FRAMES || avail > frames + MON_MAX_LAG) {
+		eie->mon_rd = eie->mon_wr - frames;
+		avail = frames;
+	}
+	frames = min(frames, avail);
+
+	for (i = 0; i < frames; i++) {
+		f = eie->mon_ring[eie->mon_rd++ % MON_RING_FRAMES];
+		for (ch = 0; ch < 4; ch++, buf += 3) {
+			v = eie_sample_s32(buf[0] | buf[1] << 8 | buf[2] << 16);
+			v += (s32) (((s64) f[ch] * eie->mon_gain[ch])
+				/ MON_GAIN_UNITY);
+			v = clamp(v, -0x800000, 0x7fffff);
+			buf[0] = v;
+			buf[1] = v >> 8;
+			buf[2] = v >> 16;
+		}
+	}
+}
+
+static void aggr_copy(struct eie *eie, struct snd_pcm_runtime *runtime,
+	unsigned char *dst, unsigned int frames, unsigned int src_frames)
+{
+	unsigned int stride = BYTES_PER_FRAME * eie_aggr.active;
+	unsigned int slot_offset = BYTES_PER_FRAME * eie->aggr_slot;
+	u32 pos;
+	unsigned char *src;
+	unsigned int i;
+
+	div_u64_rem(eie->aggr_read, runtime->buffer_size, &pos);
+	src = runtime->dma_area + pos * stride + slot_offset;
+
+	/* src_frames is frames - 1 (repeat the last) or frames + 1 (drop one) */
+	for (i = 0; i < frames; i++) {
+		memcpy(dst, src, BYTES_PER_FRAME);
+		dst += BYTES_PER_FRAME;
+		if (i + 1 >= src_frames)
+			continue;
+		if (++pos < runtime->buffer_size) {
+			src += stride;
+		} else {
+			pos = 0;
+			src = runtime->dma_area + slot_offset;
+		}
+	}
+}
+
+/* Fills the URB from the aggregate stream. Returns false if not aggregated. */
+static bool aggr_fill(struct eie *eie, struct eie_playback_urb *epu,
+	unsigned int frames)
 {
 	struct snd_pcm_runtime *runtime;
+	struct eie *master;
+	unsigned int src_frames = frames;
+	int lead;
+	bool filled = false;
+
+	if (!READ_ONCE(eie->aggr_running))
+		return false;
+
+	spin_lock(&eie_aggr.lock);
+	master = eie_aggr.units[0];
+	if (!eie->aggr_running || !eie_aggr.substream || !master)
+		goto out;
+	runtime = eie_aggr.substream->runtime;
+
+	eie->aggr_drift += (256 * (atomic64_read(&eie->aggr_clock)
+		- atomic64_read(&master->aggr_clock)) - eie->aggr_drift) / 16;
+	lead = div_s64(eie->aggr_drift, 256);
+	if (lead > eie->aggr_slip) {
+		src_frames--;
+		eie->aggr_slip++;
+	} else if (lead < eie->aggr_slip) {
+		src_frames++;
+		eie->aggr_slip--;
+	}
+
+	aggr_copy(eie, runtime, epu->urb->transfer_buffer, frames, src_frames);
+	eie->aggr_read += src_frames;
+
+	if (eie == master) {
+		eie_aggr.period_frames += src_frames;
+		if (eie_aggr.period_frames >= runtime->period_size) {
+			eie_aggr.period_frames %= runtime->period_size;
+			eie->aggr_elapsed = eie_aggr.substream;
+		}
+	}
+
+	epu->silent = false;
+	epu->len = frames;
+	filled = true;
+out:
+	spin_unlock(&eie_aggr.lock);
+	return filled;
+}
+
+/* Copies frames to the loopback buffer at pos, returns the position after. */
+static unsigned int loopback_write(struct eie *eie, unsigned int pos,
+	const u8 *buf, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = eie->loop_substream->runtime;
+	unsigned int part;
+
+	while (frames > 0) {
+		part = min(frames, runtime->buffer_size - pos);
+		memcpy(runtime->dma_area + pos * BYTES_PER_FRAME, buf,
+			part * BYTES_PER_FRAME);
+		buf += part * BYTES_PER_FRAME;
+		frames -= part;
+		pos = (pos + part) % runtime->buffer_size;
+	}
+	return pos;
+}
+
+/* Copies the frames of a filled playback URB to the loopback. */
+static void loopback_put(struct eie *eie, struct eie_playback_urb *epu,
+	unsigned int frames)
+{
+	epu->loop_wr = eie->loop_wr;
+	epu->looped = true;
+	eie->loop_wr = loopback_write(eie, eie->loop_wr,
+		epu->urb->transfer_buffer, frames);
+	eie->loop_written += frames;
+}
+
+/*
+ * Gives each packet the frames the device consumed in the same microframe
+ * of the previous clock pattern, so the device FIFO gets what it empties.
+ * The URB plays after all those in flight, a spare filled ahead with
+ * bh_urbs one URB later than one filled in the completion. Microframes not
+ * recorded yet are taken one pattern earlier. The difference to the
+ * wanted frames is spread evenly. Returns false when the history is too
+ * short or the shape does not fit.
+ */
+static bool shape_from_clock(struct eie *eie, unsigned int frames,
+	unsigned int pkts, unsigned int *pkt_frames)
+{
+	unsigned int pos = READ_ONCE(eie->clock_hist_pos);
+	unsigned int ahead = pkts * eie->play_in_flight;
+	unsigned int src = pos + ahead % CLOCK_PATTERN - CLOCK_PATTERN;
+	unsigned int max = eie->play_packet_size / BYTES_PER_FRAME;
+	unsigned int sum = 0;
+	unsigned int i, j, n;
+
+	if (pos < CLOCK_PATTERN)
+		return false;
+
+	for (i = 0; i < pkts; i++) {
+		j = src + i < pos ? src + i : src + i - CLOCK_PATTERN;
+		pkt_frames[i] = eie->clock_hist[j % CLOCK_HIST];
+		sum += pkt_frames[i];
+	}
+
+	n = abs((int) frames - (int) sum);
+	if (n > pkts)
+		return false;
+	for (i = 0; i < n; i++) {
+		j = (2 * i + 1) * pkts / (2 * n);
+		if (frames > sum)
+			pkt_frames[j]++;
+		else if (pkt_frames[j] > 0)
+			pkt_frames[j]--;
+		else
+			return false;
+	}
+
+	for (i = 0; i < pkts; i++)
+		if (pkt_frames[i] > max)
+			return false;
+	return true;
+}
+
+static void set_iso_desc(struct urb *urb, const unsigned int *pkt_frames,
+	unsigned int pkts)
+{
+	unsigned int filled = 0;
+	unsigned int i;
+
+	for (i = 0; i < pkts; i++) {
+		urb->iso_frame_desc[i].offset = filled * BYTES_PER_FRAME;
+		urb->iso_frame_desc[i].length = pkt_frames[i] * BYTES_PER_FRAME;
+		filled += pkt_frames[i];
+	}
+}
+
+/*
+ * Sets the iso packets of the URB, from the table unless the clock is far
+ * off. URBs mostly repeat the layout they had, so that is not rewritten.
+ */
+static void set_iso_layout(struct eie *eie, struct eie_playback_urb *epu,
+	unsigned int frames, unsigned int pkts)
+{
+	const struct eie_pkt_desc *d;
+	unsigned int pkt_frames[PLAY_PKT_CNT];
+	struct urb *urb = epu->urb;
+	unsigned int i;
+
+	if (shape_packets && shape_from_clock(eie, frames, pkts, pkt_frames)) {
+		urb->number_of_packets = pkts;
+		set_iso_desc(urb, pkt_frames, pkts);
+		/* the shape changes with every URB, nothing to remember */
+		epu->layout_frames = 0;
+		return;
+	}
+
+	if (epu->layout_frames == frames && epu->layout_pkts == pkts)
+		return;
+
+	urb->number_of_packets = pkts;
+	d = eie_layout_lookup(&eie->layouts, frames, pkts);
+	if (d) {
+		for (i = 0; i < pkts; i++) {
+			urb->iso_frame_desc[i].offset = d[i].offset;
+			urb->iso_frame_desc[i].length = d[i].length;
+		}
+	} else {
+		eie_iso_layout(frames, pkts, pkt_frames);
+		set_iso_desc(urb, pkt_frames, pkts);
+	}
+
+	epu->layout_frames = frames;
+	epu->layout_pkts = pkts;
+}
+
+/* S24_3LE is what the device takes, the 32-bit formats are packed. */
+static void pack_playback_frames(struct eie *eie, const u8 *src, u8 *buf,
+	unsigned int frames)
+{
+	if (eie->play_frame_bytes == BYTES_PER_FRAME)
+		memcpy(buf, src, frames * BYTES_PER_FRAME);
+	else
+		eie_pack_frames32(src, buf, frames, eie->play_shift);
+}
+
+/* Copies the next frames of the ALSA buffer to buf and counts them played. */
+static void copy_playback_frames(struct eie *eie, u8 *buf, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = eie->play_substream->runtime;
+	unsigned char *start = runtime->dma_area
+		+ eie->play_buf_pos * eie->play_frame_bytes;
+	unsigned int part;
+
+	if (eie->play_buf_pos + frames <= runtime->buffer_size) {
+		pack_playback_frames(eie, start, buf, frames);
+	} else {
+		part = runtime->buffer_size - eie->play_buf_pos;
+		pack_playback_frames(eie, start, buf, part);
+		pack_playback_frames(eie, runtime->dma_area,
+			buf + part * BYTES_PER_FRAME, frames - part);
+	}
+	eie->play_buf_pos = (eie->play_buf_pos + frames) % runtime->buffer_size;
+	if (meter_playback)
+		meter_playback_frames(&eie->play_meter, buf, frames);
+	eie->played_frames += frames;
+	runtime->delay += frames;
+}
+
+static void record_play_start(struct eie *eie, u64 frame)
+{
+	eie->play_start = frame;
+	eie->play_start_pending = false;
+	dev_dbg(&eie->udev->dev, "Playback starts at frame %llu, %lld after the trigger",
+		frame, (s64) (frame - eie->play_trigger_pos));
+}
+
+/**
+ * Returns 0 on success, -EPIPE when the ALSA buffer cannot feed the URB (the
+ * URB is then filled with silence) or another negative value for error.
+ */
+static __must_check int fill_playback_urb(struct eie_playback_urb *epu)
+{
 	struct eie *eie = epu->eie;
 	struct urb *urb = epu->urb;
 
 	unsigned int frames_wanted = calc_frames_wanted(eie);
 	unsigned int frames_elapsed = atomic_xchg(&eie->frames_elapsed, 0);
-	unsigned int frames_filled = 0;
 	unsigned int bytes_wanted;
-	unsigned char *start;
-
-	int i;
+	bool running = test_bit(PLAYBACK_RUNNING, &eie->states);
+	int ret = 0;
 
 	/* adjust frames_wanted by the frames_elapsed from EIE */
-	if ((frames_elapsed > frames_wanted - 10)
-		&& (frames_elapsed < frames_wanted + 10)) {
-		frames_wanted = frames_elapsed;
-	}
+	frames_wanted = eie_frames_adjust(frames_wanted, frames_elapsed);
 	bytes_wanted = BYTES_PER_FRAME * frames_wanted;
 
 	if (bytes_wanted > urb->transfer_buffer_length)
 		return -EINVAL;
 
-	if (test_bit(PLAYBACK_RUNNING, &eie->states)) {
-		runtime = eie->play_substream->runtime;
+	epu->queued = frames_wanted;
+	eie->play_queued += frames_wanted;
+	epu->first = eie->play_sent;
+	eie->play_sent += frames_wanted;
 
-		if (frames_wanted > runtime->buffer_size)
-			return -EINVAL;
+	if (running && frames_wanted > eie->play_substream->runtime->buffer_size) {
+		running = false;
+		ret = -EPIPE;
+	}
 
-		/* copy from ALSA's buffer to urb */
-		start = runtime->dma_area + eie->play_buf_pos * BYTES_PER_FRAME;
-		if (eie->play_buf_pos + frames_wanted <= runtime->buffer_size) {
-			memcpy(urb->transfer_buffer, start, bytes_wanted);
-			eie->play_buf_pos += frames_wanted;
-		} else {
-			unsigned int part_bytes = BYTES_PER_FRAME *
-				(runtime->buffer_size - eie->play_buf_pos);
-			memcpy(urb->transfer_buffer, start, part_bytes);
-			memcpy(urb->transfer_buffer + part_bytes,
-				runtime->dma_area,
-				bytes_wanted - part_bytes);
-			eie->play_buf_pos += frames_wanted;
-		}
-		eie->play_buf_pos %= runtime->buffer_size;
-		eie->played_frames += frames_wanted;
-		runtime->delay += frames_wanted;
+	if (aggr_fill(eie, epu, frames_wanted)) {
+		/* the unit plays its part of the aggregate stream */
+	} else if (running) {
+		if (eie->play_start_pending)
+			record_play_start(eie, epu->first);
+		copy_playback_frames(eie, urb->transfer_buffer, frames_wanted);
 		epu->silent = false;
 		epu->len = frames_wanted;
 	} else {
-		if (!epu->silent && frames_wanted <= epu->len) {
+		/* when silent, len is the number of already zeroed frames */
+		if (!epu->silent || frames_wanted > epu->len) {
 			memset(urb->transfer_buffer, 0, bytes_wanted);
 			epu->len = frames_wanted;
 			epu->silent = true;
 		}
 	}
 
-	/* adjust iso frame sizes */
-	for (i = 0; i < PLAY_PKT_CNT; i++) {
-		int len =  frames_wanted * (i+1) / PLAY_PKT_CNT - frames_filled;
-
-		urb->iso_frame_desc[i].offset = frames_filled * BYTES_PER_FRAME;
-		urb->iso_frame_desc[i].length = len * BYTES_PER_FRAME;
-		frames_filled += len;
+	if (eie->mon_enabled) {
+		monitor_mix(eie, urb->transfer_buffer, frames_wanted);
+		/* not zeroed any more, but carries no frames of the substream */
+		if (epu->silent) {
+			epu->silent = false;
+			epu->len = 0;
+		}
 	}
 
-	return 0;
+	if (test_bit(LOOPBACK_RUNNING, &eie->states))
+		loopback_put(eie, epu, frames_wanted);
+
+	set_iso_layout(eie, epu, frames_wanted, eie->play_pkts);
+
+	return ret;
+}
+
+/*
+ * Consumes the whole periods in *frames and keeps the rest for the next
+ * call. ALSA reads the exact position from the pointer callback, so one
+ * notification covers any number of elapsed periods.
+ */
+static bool periods_elapsed(unsigned int *frames,
+	struct snd_pcm_runtime *runtime)
+{
+	if (*frames < runtime->period_size)
+		return false;
+	*frames %= runtime->period_size;
+	return true;
 }
 
 static bool check_period_elapsed(struct eie *eie)
 {
 	struct snd_pcm_substream *substream = eie->play_substream;
 
-	if (substream != NULL
-		&& eie->played_frames >= substream->runtime->period_size) {
-		eie->played_frames %= substream->runtime->period_size;
-		return true;
-	}
-	return false;
+	if (substream == NULL
+		|| !periods_elapsed(&eie->played_frames, substream->runtime))
+		return false;
+	meter_publish(&eie->play_meter);
+	return true;
+}
+
+/*
+ * Moves the loopback position by the frames the device clock played. Those
+ * in flight when the loopback started were not recorded, so the position
+ * waits for them first. Returns true when a period elapsed.
+ */
+static bool loopback_played(struct eie *eie, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime;
+	unsigned long flags;
+	bool elapsed = false;
+	u64 played;
+	unsigned int delta;
+
+	spin_lock_irqsave(&eie->lock, flags);
+	if (!test_bit(LOOPBACK_RUNNING, &eie->states))
+		goto out;
+	runtime = eie->loop_substream->runtime;
+
+	eie->loop_played += frames;
+	if (eie->loop_played <= 0)
+		goto out;
+	played = min_t(u64, eie->loop_played, eie->loop_written);
+	delta = played - eie->loop_reported;
+	eie->loop_reported = played;
+
+	eie->loop_buf_pos = (eie->loop_buf_pos + delta) % runtime->buffer_size;
+	eie->loop_frames += delta;
+	elapsed = periods_elapsed(&eie->loop_frames, runtime);
+out:
+	spin_unlock_irqrestore(&eie->lock, flags);
+	return elapsed;
 }
 
 static int submit_init_play_urbs(struct eie *eie)
@@ -519,55 +1455,188 @@ static int submit_init_play_urbs(struct eie *eie)
 
 	spin_lock_irqsave(&eie->lock, flags);
 
+	/* whatever was in flight before has been killed */
+	if (eie->play_substream && eie->play_substream->runtime)
+		eie->play_substream->runtime->delay = 0;
+	eie->play_queued = 0;
+	eie->play_sent = 0;
+	eie->play_in_flight = 0;
+
 	for (i = 0; i < PLAY_URB_CNT; i++) {
 		/* init the urb state */
 		eie->play_urbs[i].silent = true;
 		eie->play_urbs[i].len = 0;
+		eie->play_urbs[i].layout_frames = 0;
+		eie->play_urbs[i].in_flight = false;
+		eie->play_urbs[i].looped = false;
+	}
 
+	for (i = 0; i < eie->play_urbs_wanted; i++) {
 		err = fill_playback_urb(&eie->play_urbs[i]);
 		if (err < 0)
 			goto out;
+		eie->play_urbs[i].in_flight = true;
 		err = usb_submit_urb(eie->play_urbs[i].urb, GFP_ATOMIC);
-		if (err < 0)
+		if (err < 0) {
+			eie->play_urbs[i].in_flight = false;
 			goto out;
+		}
+		eie->play_in_flight++;
 	}
 
+	eie->play_spare = &eie->play_urbs[eie->play_urbs_wanted];
+	eie->play_spare_filled = false;
+	if (bh_urbs)
+		queue_work(system_highpri_wq, &eie->urb_work);
+
 out:
 	spin_unlock_irqrestore(&eie->lock, flags);
 
 	return err;
 }
 
-static int eie_ppcm_trigger(struct snd_pcm_substream *substream, int cmd)
+/*
+ * The URBs in flight and a filled spare carry silence when playback starts,
+ * which would hold the first frame back by up to 10 ms. With early set,
+ * the audio is copied into them from the first microframe the controller
+ * has not fetched yet. The microframe being sent is estimated from the time
+ * since the last completion, which lags the controller, so the lead is
+ * generous. The controller may still have read the buffer already, that is
+ * why early_start is off by default. URBs carrying the monitor or the
+ * aggregate stream are not silent, those starts wait for the next fill.
+ */
+static void start_playback(struct eie *eie, bool early)
 {
-	struct eie *eie = substream->private_data;
+	struct eie_playback_urb *order[PLAY_URB_CNT];
+	struct eie_playback_urb *epu;
+	struct urb *urb;
+	ktime_t active = READ_ONCE(eie->play_active);
+	unsigned int avail = eie->play_substream->runtime->buffer_size;
+	unsigned int n = 0;
+	unsigned int i, j, mf, lead, start, pkts, from, frames;
+	u8 *buf;
+
+	eie->play_start_pending = true;
+	/* the first frame of the oldest URB, refined below once they flow */
+	eie->play_trigger_pos = eie->play_sent - eie->play_queued;
+	if (active == 0)
+		return;
+	/* pairs with the barrier in play_urb_complete() */
+	smp_rmb();
 
-	switch (cmd) {
-	case SNDRV_PCM_TRIGGER_START:
-		dev_dbg(&eie->udev->dev, "play: SNDRV_PCM_TRIGGER_START");
-		set_bit(PLAYBACK_RUNNING, &eie->states);
-		return 0;
-	case SNDRV_PCM_TRIGGER_STOP:
-		dev_dbg(&eie->udev->dev, "play: SNDRV_PCM_TRIGGER_STOP");
-		clear_bit(PLAYBACK_RUNNING, &eie->states);
-		return 0;
-	default:
-		return -EINVAL;
+	/* the URBs not sent yet, oldest first */
+	for (i = 0; i < PLAY_URB_CNT; i++) {
+		epu = &eie->play_urbs[i];
+		if (!READ_ONCE(epu->in_flight)
+			&& !(epu == eie->play_spare && eie->play_spare_filled))
+			continue;
+		for (j = n++; j > 0 && order[j - 1]->first > epu->first; j--)
+			order[j] = order[j - 1];
+		order[j] = epu;
+	}
+
+	mf = ktime_us_delta(ktime_get(), active) / 125;
+	lead = mf + START_LEAD_MF;
+	for (i = 0, start = 0; i < n; i++, start += pkts) {
+		epu = order[i];
+		urb = epu->urb;
+		pkts = urb->number_of_packets;
+		if (mf >= start && mf < start + pkts)
+			eie->play_trigger_pos = epu->first
+				+ urb->iso_frame_desc[mf - start].offset
+				/ BYTES_PER_FRAME;
+		if (!early || lead >= start + pkts)
+			continue;
+		if (!epu->silent)
+			break;
+
+		from = lead > start ? urb->iso_frame_desc[lead - start].offset
+			/ BYTES_PER_FRAME : 0;
+		frames = epu->queued - from;
+		if (frames > avail)
+			break;
+		avail -= frames;
+
+		buf = urb->transfer_buffer + from * BYTES_PER_FRAME;
+		if (eie->play_start_pending)
+			record_play_start(eie, epu->first + from);
+		copy_playback_frames(eie, buf, frames);
+		epu->silent = false;
+		epu->len = frames;
+		if (epu->looped && test_bit(LOOPBACK_RUNNING, &eie->states))
+			loopback_write(eie, (epu->loop_wr + from)
+				% eie->loop_substream->runtime->buffer_size,
+				buf, frames);
 	}
 }
 
-static int eie_cpcm_trigger(struct snd_pcm_substream *substream, int cmd)
+/*
+ * Handles both directions. When the substreams are linked, both are
+ * triggered here under eie->lock, so they start on the same device frame:
+ * the capture drops the frames that the device clocks out before the first
+ * playback frame, i.e. those queued in the playback URBs and not sent yet,
+ * as start_playback() estimates them. A
+ * playback started alone may go out early, see start_playback().
+ *
+ * Pausing only stops the transfer of audio, the URBs keep running on
+ * silence and the release continues from the same buffer position. Resume
+ * after a system sleep works the same way once eie_resume() has restarted
+ * the URBs.
+ */
+static int eie_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct eie *eie = substream->private_data;
+	struct snd_pcm_substream *s;
+	unsigned long flags;
+	bool play = false;
+	bool cap = false;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		/* the loopback and the raw capture have their own trigger */
+		if (snd_pcm_substream_chip(s) != eie || s == eie->loop_substream
+			|| s == eie->raw_substream)
+			continue;
+		if (s->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			play = true;
+		else
+			cap = true;
+		snd_pcm_trigger_done(s, substream);
+	}
 
 	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_RESUME:
+		/* eie_resume() could not restart the device */
+		if (READ_ONCE(eie->rate) == 0)
+			return -EIO;
+		fallthrough;
 	case SNDRV_PCM_TRIGGER_START:
-		dev_dbg(&eie->udev->dev, "cap: SNDRV_PCM_TRIGGER_START");
-		set_bit(CAPTURE_RUNNING, &eie->states);
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		dev_dbg(&eie->udev->dev, "Trigger start (%d) play: %d cap: %d",
+			cmd, play, cap);
+		spin_lock_irqsave(&eie->lock, flags);
+		if (play) {
+			set_bit(PLAYBACK_RUNNING, &eie->states);
+			/* a linked start keeps its alignment with the capture */
+			start_playback(eie, !cap && READ_ONCE(early_start));
+		}
+		if (play && cap) {
+			/* what the device plays before the next filled frame */
+			eie->cap_skip = eie->play_sent - eie->play_trigger_pos;
+			eie->link_offset = eie->cap_skip;
+		}
+		if (cap)
+			set_bit(CAPTURE_RUNNING, &eie->states);
+		spin_unlock_irqrestore(&eie->lock, flags);
 		return 0;
 	case SNDRV_PCM_TRIGGER_STOP:
-		dev_dbg(&eie->udev->dev, "cap: SNDRV_PCM_TRIGGER_STOP");
-		clear_bit(CAPTURE_RUNNING, &eie->states);
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		dev_dbg(&eie->udev->dev, "Trigger stop (%d) play: %d cap: %d",
+			cmd, play, cap);
+		if (play)
+			clear_bit(PLAYBACK_RUNNING, &eie->states);
+		if (cap)
+			clear_bit(CAPTURE_RUNNING, &eie->states);
 		return 0;
 	default:
 		return -EINVAL;
@@ -610,6 +1679,10 @@ static int eie_min_open(struct snd_rawmidi_substream *substream)
 	if (test_bit(MIN_OPEN, &eie->states))
 		return -EINVAL;
 
+	err = usb_autopm_get_interface(eie->ifa);
+	if (err < 0)
+		return err;
+
 	for (i = 0; i < MIN_URB_CNT; i++) {
 		err = usb_submit_urb(eie->min_urbs[i], GFP_KERNEL);
 		if (err < 0)
@@ -622,6 +1695,7 @@ static int eie_min_open(struct snd_rawmidi_substream *substream)
 err:
 	for (i = 0; i < MIN_URB_CNT; i++)
 		usb_kill_urb(eie->min_urbs[i]);
+	usb_autopm_put_interface(eie->ifa);
 	dev_dbg(&eie->udev->dev, "Urb problem: %s", usb_error_string(err));
 
 	return err;
@@ -639,6 +1713,7 @@ static int eie_min_close(struct snd_rawmidi_substream *substream)
 	clear_bit(MIN_OPEN, &eie->states);
 	clear_bit(MIN_UP, &eie->states);
 	eie->min_substream = NULL;
+	usb_autopm_put_interface(eie->ifa);
 	return 0;
 }
 
@@ -656,7 +1731,9 @@ static void eie_min_trigger(struct snd_rawmidi_substream *substream, int up)
 
 static int eie_mout_open(struct snd_rawmidi_substream *substream)
 {
-	return 0;
+	struct eie *eie = substream->rmidi->private_data;
+
+	return usb_autopm_get_interface(eie->ifa);
 }
 
 static int eie_mout_close(struct snd_rawmidi_substream *substream)
@@ -667,6 +1744,7 @@ static int eie_mout_close(struct snd_rawmidi_substream *substream)
 	for (i = 0; i < MOUT_URB_CNT; i++)
 		usb_kill_urb(eie->mout_urbs[i]);
 
+	usb_autopm_put_interface(eie->ifa);
 	return 0;
 }
 
@@ -709,122 +1787,717 @@ static void eie_mout_trigger(struct snd_rawmidi_substream *substream, int up)
 	}
 }
 
-static const struct snd_pcm_ops eie_playback_pcm_ops = {
-	.open = eie_ppcm_open,
-	.close = eie_ppcm_close,
-	.ioctl = snd_pcm_lib_ioctl,
-	.hw_params = eie_pcm_hw_params,
-	.hw_free = eie_pcm_hw_free,
-	.prepare = eie_ppcm_prepare,
-	.trigger = eie_ppcm_trigger,
-	.pointer = eie_ppcm_pointer,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
-	.page = snd_pcm_lib_get_vmalloc_page,
-#else
-	.page = eie_get_page,
-#endif
-};
+static int eie_lpcm_open(struct snd_pcm_substream *substream)
+{
+	struct eie *eie = substream->private_data;
+	int err;
 
-static const struct snd_pcm_ops eie_capture_pcm_ops = {
-	.open = eie_cpcm_open,
-	.close = eie_cpcm_close,
-	.ioctl = snd_pcm_lib_ioctl,
-	.hw_params = eie_pcm_hw_params,
-	.hw_free = eie_pcm_hw_free,
-	.prepare = eie_cpcm_prepare,
-	.trigger = eie_cpcm_trigger,
-	.pointer = eie_cpcm_pointer,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
-	.page = snd_pcm_lib_get_vmalloc_page,
-#else
-	.page = eie_get_page,
-#endif
-};
+	err = eie_prepare_hw(substream);
+	if (err < 0)
+		return err;
+	err = usb_autopm_get_interface(eie->ifa);
+	if (err < 0)
+		return err;
+	eie->loop_substream = substream;
+	return 0;
+}
 
-static const struct snd_rawmidi_ops eie_midi_out_ops = {
-	.open = eie_mout_open,
-	.close = eie_mout_close,
-	.trigger = eie_mout_trigger,
-};
+static int eie_lpcm_close(struct snd_pcm_substream *substream)
+{
+	struct eie *eie = substream->private_data;
 
-static const struct snd_rawmidi_ops eie_midi_in_ops = {
-	.open = eie_min_open,
-	.close = eie_min_close,
-	.trigger = eie_min_trigger,
-};
+	WRITE_ONCE(eie->stream_rate[substream_slot(substream)], 0);
+	eie->loop_substream = NULL;
+	usb_autopm_put_interface(eie->ifa);
 
-static void abort_playback(struct eie *eie)
+	return 0;
+}
+
+/* The loopback is pinned to the device rate like the other substreams. */
+static int eie_lpcm_prepare(struct snd_pcm_substream *substream)
 {
-	unsigned long flags;
+	struct eie *eie = substream->private_data;
+	int err;
 
-	if (test_bit(PLAYBACK_RUNNING, &eie->states)
-		&& eie->play_substream != NULL) {
-		snd_pcm_stream_lock_irqsave(eie->play_substream, flags);
-		snd_pcm_stop(eie->play_substream, SNDRV_PCM_STATE_XRUN);
-		snd_pcm_stream_unlock_irqrestore(eie->play_substream, flags);
-	}
+	err = set_stream_rate(substream, eie);
 
-	if (test_bit(CAPTURE_RUNNING, &eie->states)
-		&& eie->cap_substream != NULL) {
-		snd_pcm_stream_lock_irqsave(eie->cap_substream, flags);
-		snd_pcm_stop(eie->cap_substream, SNDRV_PCM_STATE_XRUN);
-		snd_pcm_stream_unlock_irqrestore(eie->cap_substream, flags);
-	}
+	eie->loop_buf_pos = 0;
+	eie->loop_frames = 0;
 
-	spin_lock_irqsave(&eie->lock, flags);
-	eie->rate = 0;
-	spin_unlock_irqrestore(&eie->lock, flags);
+	return err;
 }
 
-static void play_urb_complete(struct urb *urb)
+/*
+ * Starts recording with the next filled playback URB. The frames it holds
+ * reach the buffer as the device clock plays them, so the position and its
+ * timestamps follow the device, not the USB transfers.
+ */
+static int eie_lpcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
-	struct eie_playback_urb *epu = urb->context;
-	struct eie *eie = epu->eie;
+	struct eie *eie = substream->private_data;
 	unsigned long flags;
-	int err;
-	bool elapsed = false;
-	bool abort = false;
+	int i;
 
-	/* for ISO this means that we have been killed or unlinked */
-	if (urb->status != 0) {
-		dev_dbg(&eie->udev->dev, "Play urb complete. %d", urb->status);
-		return;
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_RESUME:
+		if (READ_ONCE(eie->rate) == 0)
+			return -EIO;
+		fallthrough;
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		spin_lock_irqsave(&eie->lock, flags);
+		eie->loop_wr = eie->loop_buf_pos;
+		eie->loop_written = 0;
+		eie->loop_reported = 0;
+		eie->loop_played = -(s64) eie->play_queued;
+		for (i = 0; i < PLAY_URB_CNT; i++)
+			eie->play_urbs[i].looped = false;
+		set_bit(LOOPBACK_RUNNING, &eie->states);
+		spin_unlock_irqrestore(&eie->lock, flags);
+		return 0;
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		clear_bit(LOOPBACK_RUNNING, &eie->states);
+		return 0;
+	default:
+		return -EINVAL;
 	}
+}
 
-	/* first URB */
-	if (!test_and_set_bit(URBS_FLOWING, &eie->states))
-		wake_up(&eie->urbs_flow_wait);
+static snd_pcm_uframes_t eie_lpcm_pointer(struct snd_pcm_substream *substream)
+{
+	unsigned long flags;
+	struct eie *eie = substream->private_data;
+	snd_pcm_uframes_t pos;
 
 	spin_lock_irqsave(&eie->lock, flags);
-	if (!epu->silent
-		&& eie->play_substream && eie->play_substream->runtime)
-		eie->play_substream->runtime->delay -= epu->len;
+	pos = eie->loop_buf_pos;
+	spin_unlock_irqrestore(&eie->lock, flags);
 
-	err = fill_playback_urb(epu);
-	if (err < 0) {
-		abort = true;
-		goto err;
+	return pos;
+}
+
+static int eie_rpcm_open(struct snd_pcm_substream *substream)
+{
+	struct eie *eie = substream->private_data;
+	int err;
+
+	err = eie_prepare_hw(substream);
+	if (err < 0)
+		return err;
+	err = usb_autopm_get_interface(eie->ifa);
+	if (err < 0)
+		return err;
+	eie->raw_substream = substream;
+	return 0;
+}
+
+static int eie_rpcm_close(struct snd_pcm_substream *substream)
+{
+	struct eie *eie = substream->private_data;
+
+	WRITE_ONCE(eie->stream_rate[substream_slot(substream)], 0);
+	update_capture_urbs(eie);
+	eie->raw_substream = NULL;
+	usb_autopm_put_interface(eie->ifa);
+
+	return 0;
+}
+
+static int eie_rpcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct eie *eie = substream->private_data;
+	int err;
+
+	err = set_stream_rate(substream, eie);
+	if (err == 0)
+		err = update_capture_urbs(eie);
+
+	eie->raw_buf_pos = 0;
+	eie->raw_frames = 0;
+
+	return err;
+}
+
+/*
+ * Frames are recorded whole, from the first complete one after the start.
+ * The raw capture is not aligned with a linked playback start.
+ */
+static int eie_rpcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct eie *eie = substream->private_data;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_RESUME:
+		if (READ_ONCE(eie->rate) == 0)
+			return -EIO;
+		fallthrough;
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		set_bit(RAW_RUNNING, &eie->states);
+		return 0;
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		clear_bit(RAW_RUNNING, &eie->states);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static snd_pcm_uframes_t eie_rpcm_pointer(struct snd_pcm_substream *substream)
+{
+	unsigned long flags;
+	struct eie *eie = substream->private_data;
+	snd_pcm_uframes_t pos;
+
+	spin_lock_irqsave(&eie->lock, flags);
+	pos = eie->raw_buf_pos;
+	spin_unlock_irqrestore(&eie->lock, flags);
+
+	return pos;
+}
+
+static const struct snd_pcm_ops eie_playback_pcm_ops = {
+	.open = eie_ppcm_open,
+	.close = eie_ppcm_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.prepare = eie_ppcm_prepare,
+	.trigger = eie_pcm_trigger,
+	.pointer = eie_ppcm_pointer,
+};
+
+static const struct snd_pcm_ops eie_capture_pcm_ops = {
+	.open = eie_cpcm_open,
+	.close = eie_cpcm_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.prepare = eie_cpcm_prepare,
+	.trigger = eie_pcm_trigger,
+	.pointer = eie_cpcm_pointer,
+};
+
+static const struct snd_pcm_ops eie_loopback_pcm_ops = {
+	.open = eie_lpcm_open,
+	.close = eie_lpcm_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.prepare = eie_lpcm_prepare,
+	.trigger = eie_lpcm_trigger,
+	.pointer = eie_lpcm_pointer,
+};
+
+static const struct snd_pcm_ops eie_raw_pcm_ops = {
+	.open = eie_rpcm_open,
+	.close = eie_rpcm_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.prepare = eie_rpcm_prepare,
+	.trigger = eie_rpcm_trigger,
+	.pointer = eie_rpcm_pointer,
+};
+
+static int eie_apcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned int active = 0;
+	unsigned int i;
+	int err;
+
+	mutex_lock(&eie_aggr.mutex);
+
+	while (active < AGGR_MAX_UNITS && eie_aggr.units[active])
+		active++;
+	for (i = 0; i < active; i++) {
+		if (eie_aggr.units[i]->play_substream) {
+			err = -EBUSY;
+			goto out;
+		}
+	}
+
+	runtime->hw = eie_aggregate_hw;
+	err = snd_pcm_hw_constraint_single(runtime,
+		SNDRV_PCM_HW_PARAM_CHANNELS, 4 * active);
+	if (err < 0)
+		goto out;
+	err = snd_pcm_hw_constraint_minmax(runtime,
+		SNDRV_PCM_HW_PARAM_BUFFER_TIME, 10*1000, MAX_BUFFER_MS*1000);
+	if (err < 0)
+		goto out;
+
+	for (i = 0; i < active; i++) {
+		err = usb_autopm_get_interface(eie_aggr.units[i]->ifa);
+		if (err < 0) {
+			while (i--) {
+				clear_bit(AGGR_OPEN, &eie_aggr.units[i]->states);
+				usb_autopm_put_interface(eie_aggr.units[i]->ifa);
+			}
+			goto out;
+		}
+		set_bit(AGGR_OPEN, &eie_aggr.units[i]->states);
+	}
+
+	spin_lock_irq(&eie_aggr.lock);
+	eie_aggr.active = active;
+	eie_aggr.substream = substream;
+	spin_unlock_irq(&eie_aggr.lock);
+out:
+	mutex_unlock(&eie_aggr.mutex);
+	return err;
+}
+
+static int eie_apcm_close(struct snd_pcm_substream *substream)
+{
+	struct eie *units[AGGR_MAX_UNITS];
+	unsigned int active;
+	unsigned int i;
+
+	mutex_lock(&eie_aggr.mutex);
+
+	spin_lock_irq(&eie_aggr.lock);
+	active = eie_aggr.active;
+	for (i = 0; i < active; i++) {
+		units[i] = eie_aggr.units[i];
+		if (units[i])
+			units[i]->aggr_running = false;
+	}
+	eie_aggr.active = 0;
+	eie_aggr.substream = NULL;
+	spin_unlock_irq(&eie_aggr.lock);
+
+	for (i = 0; i < active; i++) {
+		if (!units[i])
+			continue;
+		set_play_pkts(units[i], PLAY_PKT_CNT);
+		WRITE_ONCE(units[i]->stream_rate[SNDRV_PCM_STREAM_PLAYBACK], 0);
+		WRITE_ONCE(units[i]->stream_period[SNDRV_PCM_STREAM_PLAYBACK], 0);
+		clear_bit(AGGR_OPEN, &units[i]->states);
+		usb_autopm_put_interface(units[i]->ifa);
+	}
+
+	mutex_unlock(&eie_aggr.mutex);
+	return 0;
+}
+
+static int eie_apcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct eie *unit;
+	unsigned int i;
+	int err = 0;
+
+	mutex_lock(&eie_aggr.mutex);
+
+	/* all units send URBs of the same length */
+	for (i = 0; i < eie_aggr.active && err == 0; i++) {
+		unit = eie_aggr.units[i];
+		if (!unit) {
+			err = -ENODEV;
+		} else {
+			set_play_pkts(unit,
+				runtime->period_size * EIE_PKT_RATE / runtime->rate);
+			err = set_stream_rate(substream, unit);
+		}
+	}
+
+	spin_lock_irq(&eie_aggr.lock);
+	for (i = 0; i < eie_aggr.active; i++) {
+		unit = eie_aggr.units[i];
+		if (unit)
+			unit->aggr_read = 0;
+	}
+	eie_aggr.period_frames = 0;
+	spin_unlock_irq(&eie_aggr.lock);
+
+	mutex_unlock(&eie_aggr.mutex);
+	return err;
+}
+
+static int eie_apcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct eie *unit;
+	bool run;
+	unsigned int i;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		run = true;
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		run = false;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	spin_lock(&eie_aggr.lock);
+	for (i = 0; i < eie_aggr.active; i++) {
+		unit = eie_aggr.units[i];
+		if (!unit)
+			continue;
+		if (run) {
+			atomic64_set(&unit->aggr_clock, 0);
+			unit->aggr_drift = 0;
+			unit->aggr_slip = 0;
+		}
+		WRITE_ONCE(unit->aggr_running, run);
+	}
+	spin_unlock(&eie_aggr.lock);
+
+	return 0;
+}
+
+/* reports the position of the unit that has read the least */
+static snd_pcm_uframes_t eie_apcm_pointer(struct snd_pcm_substream *substream)
+{
+	u64 read = U64_MAX;
+	unsigned int i;
+	u32 pos;
+
+	spin_lock(&eie_aggr.lock);
+	for (i = 0; i < eie_aggr.active; i++)
+		if (eie_aggr.units[i])
+			read = min(read, eie_aggr.units[i]->aggr_read);
+	spin_unlock(&eie_aggr.lock);
+
+	if (read == U64_MAX)
+		return 0;
+	div_u64_rem(read, substream->runtime->buffer_size, &pos);
+	return pos;
+}
+
+static const struct snd_pcm_ops eie_aggregate_pcm_ops = {
+	.open = eie_apcm_open,
+	.close = eie_apcm_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.prepare = eie_apcm_prepare,
+	.trigger = eie_apcm_trigger,
+	.pointer = eie_apcm_pointer,
+};
+
+static const struct snd_rawmidi_ops eie_midi_out_ops = {
+	.open = eie_mout_open,
+	.close = eie_mout_close,
+	.trigger = eie_mout_trigger,
+};
+
+static const struct snd_rawmidi_ops eie_midi_in_ops = {
+	.open = eie_min_open,
+	.close = eie_min_close,
+	.trigger = eie_min_trigger,
+};
+
+static void flight_record(struct eie *eie, unsigned int kind, int status,
+	unsigned int frames, unsigned int aux)
+{
+	struct eie_flight *fr = &eie->flight;
+	struct eie_flight_entry *e;
+
+	if (atomic_read(&fr->frozen))
+		return;
+
+	e = &fr->entries[(atomic_inc_return(&fr->head) - 1)
+		& (FLIGHT_ENTRIES - 1)];
+	e->time = ktime_get();
+	e->status = status;
+	e->frames = min(frames, (unsigned int) U16_MAX);
+	e->kind = kind;
+	e->aux = min(aux, (unsigned int) U8_MAX);
+}
+
+static void flight_freeze(struct eie *eie, const char *reason)
+{
+	struct eie_flight *fr = &eie->flight;
+
+	if (atomic_cmpxchg(&fr->frozen, 0, 1) != 0)
+		return;
+
+	fr->frozen_at = ktime_get();
+	WRITE_ONCE(fr->reason, reason);
+	dev_dbg(&eie->udev->dev, "Flight recorder frozen: %s", reason);
+}
+
+static void xrun_substream(struct snd_pcm_substream *substream)
+{
+	unsigned long flags;
+
+	snd_pcm_stream_lock_irqsave(substream, flags);
+	snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+}
+
+/*
+ * Stops both substreams and forces a full device reset on the next prepare.
+ * Used only when restarting the URBs did not help.
+ */
+static void abort_playback(struct eie *eie)
+{
+	unsigned long flags;
+
+	flight_freeze(eie, "abort");
+
+	if (test_bit(PLAYBACK_RUNNING, &eie->states)
+		&& eie->play_substream != NULL)
+		xrun_substream(eie->play_substream);
+
+	if (test_bit(CAPTURE_RUNNING, &eie->states)
+		&& eie->cap_substream != NULL)
+		xrun_substream(eie->cap_substream);
+
+	if (test_bit(RAW_RUNNING, &eie->states)
+		&& eie->raw_substream != NULL)
+		xrun_substream(eie->raw_substream);
+
+	spin_lock_irqsave(&eie->lock, flags);
+	eie->rate = 0;
+	spin_unlock_irqrestore(&eie->lock, flags);
+}
+
+/*
+ * Reports a failure of the USB streams. The recovery work restarts the URBs
+ * without touching the device configuration, so the substreams keep running
+ * and only lose the audio that was in flight.
+ */
+static void stream_error(struct eie *eie, const char *what)
+{
+	if (test_bit(SUSPENDED, &eie->states)
+		|| test_bit(DISCONNECTED, &eie->states)
+		|| test_and_set_bit(RECOVERING, &eie->states))
+		return;
+
+	dev_warn(&eie->udev->dev, "Stream error: %s, restarting.", what);
+	schedule_work(&eie->recovery_work);
+}
+
+static bool restart_allowed(struct eie *eie)
+{
+	if (time_after(jiffies, eie->restart_window
+			+ msecs_to_jiffies(RESTART_WINDOW_MS))) {
+		eie->restart_window = jiffies;
+		eie->restarts = 0;
+	}
+
+	return ++eie->restarts <= RESTART_LIMIT;
+}
+
+static void eie_recovery_work(struct work_struct *work)
+{
+	struct eie *eie = container_of(work, struct eie, recovery_work);
+
+	/* a prepare may be resetting the device meanwhile */
+	mutex_lock(&eie->reset_mutex);
+	if (test_bit(DISCONNECTED, &eie->states))
+		goto unlock;
+	kill_all_urbs(eie);
+	eie->clock_glitches = 0;
+
+	if (eie->rate != 0
+		&& (!restart_allowed(eie) || start_streams(eie) < 0)) {
+		dev_err(&eie->udev->dev, "Cannot recover streams, resetting.");
+		abort_playback(eie);
+	}
+unlock:
+	mutex_unlock(&eie->reset_mutex);
+	clear_bit(RECOVERING, &eie->states);
+}
+
+static bool stream_stalled(ktime_t active, ktime_t now, unsigned int ms)
+{
+	return active != 0 && ktime_ms_delta(now, active) > ms;
+}
+
+static enum hrtimer_restart eie_watchdog(struct hrtimer *timer)
+{
+	struct eie *eie = container_of(timer, struct eie, watchdog);
+	unsigned int ms = READ_ONCE(watchdog_ms);
+	ktime_t now = ktime_get();
+	const char *stalled = NULL;
+
+	if (ms == 0 || test_bit(DISCONNECTED, &eie->states))
+		return HRTIMER_NORESTART;
+
+	if (stream_stalled(READ_ONCE(eie->sync_active), now, ms))
+		stalled = "clock";
+	else if (stream_stalled(READ_ONCE(eie->play_active), now, ms))
+		stalled = "playback";
+	else if (test_bit(CAPTURE_URBS, &eie->states)
+		&& stream_stalled(READ_ONCE(eie->cap_active), now, ms))
+		stalled = "capture";
+
+	if (stalled) {
+		stream_error(eie, stalled);
+		return HRTIMER_NORESTART;
 	}
 
-	elapsed = test_bit(PLAYBACK_RUNNING, &eie->states)
+	hrtimer_forward_now(timer, ms_to_ktime(ms));
+	return HRTIMER_RESTART;
+}
+
+static void start_watchdog(struct eie *eie)
+{
+	unsigned int ms = READ_ONCE(watchdog_ms);
+
+	if (ms == 0)
+		return;
+	hrtimer_start(&eie->watchdog, ms_to_ktime(ms), HRTIMER_MODE_REL);
+}
+
+/* Called under eie->lock. Returns -EPIPE on xrun like fill_playback_urb. */
+static int refill_playback_urb(struct eie_playback_urb *epu, bool *elapsed)
+{
+	struct eie *eie = epu->eie;
+	int err;
+
+	err = fill_playback_urb(epu);
+	if (err < 0 && err != -EPIPE)
+		return err;
+
+	*elapsed = test_bit(PLAYBACK_RUNNING, &eie->states)
 		&& check_period_elapsed(eie);
+	return err;
+}
+
+/* Reports what the last fill found. Called without eie->lock. */
+static void notify_playback(struct eie *eie, bool elapsed, bool xrun,
+	struct snd_pcm_substream *aggr_elapsed)
+{
+	if (elapsed)
+		snd_pcm_period_elapsed(eie->play_substream);
+	if (aggr_elapsed)
+		snd_pcm_period_elapsed(aggr_elapsed);
+	if (xrun) {
+		flight_freeze(eie, "playback xrun");
+		xrun_substream(eie->play_substream);
+	}
+}
+
+/*
+ * Called under eie->lock. Submits idle URBs until play_urbs_wanted are in
+ * flight, after the URBs got shorter. A filled spare holds the next frames,
+ * so it goes first and the idle URB becomes the spare.
+ */
+static int add_playback_urbs(struct eie *eie, bool *elapsed, bool *xrun)
+{
+	struct eie_playback_urb *epu;
+	unsigned int i;
+	bool e = false;
+	int err;
+
+	for (i = 0; i < PLAY_URB_CNT; i++) {
+		if (eie->play_in_flight >= eie->play_urbs_wanted)
+			break;
+		epu = &eie->play_urbs[i];
+		if (epu->in_flight || epu == eie->play_spare)
+			continue;
+
+		if (bh_urbs && eie->play_spare_filled) {
+			swap(epu, eie->play_spare);
+			eie->play_spare_filled = false;
+		} else {
+			err = refill_playback_urb(epu, &e);
+			if (err < 0 && err != -EPIPE)
+				return err;
+			*elapsed |= e;
+			*xrun |= err == -EPIPE;
+		}
+
+		epu->in_flight = true;
+		err = usb_submit_urb(epu->urb, GFP_ATOMIC);
+		if (err < 0) {
+			epu->in_flight = false;
+			return err;
+		}
+		eie->play_in_flight++;
+	}
+	return 0;
+}
+
+/*
+ * With bh_urbs, the completion only submits the spare URB that the URB work
+ * has filled ahead and hands the completed one over as the new spare. If the
+ * work did not make it in time, the completed URB is filled here as usual.
+ * When the URBs got longer, the completed URB stays idle until fewer are in
+ * flight than play_urbs_wanted, when they got shorter, idle ones are added.
+ */
+static void play_urb_complete(struct urb *urb)
+{
+	struct eie_playback_urb *epu = urb->context;
+	struct eie_playback_urb *next = epu;
+	struct eie *eie = epu->eie;
+	unsigned long flags;
+	int err;
+	bool elapsed = false;
+	bool xrun = false;
+	struct snd_pcm_substream *aggr_elapsed;
+
+	/* no start may patch the URB once it is back, see start_playback() */
+	WRITE_ONCE(epu->in_flight, false);
+
+	/* for ISO this means that we have been killed or unlinked */
+	if (urb->status != 0) {
+		dev_dbg(&eie->udev->dev, "Play urb complete. %d", urb->status);
+		flight_record(eie, FLIGHT_PLAY, urb->status, 0, 0);
+		return;
+	}
+
+	smp_wmb();
+	WRITE_ONCE(eie->play_active, ktime_get());
+
+	/* first URB */
+	if (!test_and_set_bit(URBS_FLOWING, &eie->states))
+		wake_up(&eie->urbs_flow_wait);
+
+	spin_lock_irqsave(&eie->lock, flags);
+	if (!epu->silent
+		&& eie->play_substream && eie->play_substream->runtime)
+		eie->play_substream->runtime->delay -= epu->len;
+	eie->play_queued -= epu->queued;
+	eie->play_in_flight--;
+
+	if (eie->play_in_flight >= eie->play_urbs_wanted) {
+		err = 0;
+		goto err;
+	}
+	if (bh_urbs && eie->play_spare_filled) {
+		next = eie->play_spare;
+		urb = next->urb;
+		eie->play_spare = epu;
+		eie->play_spare_filled = false;
+		err = 0;
+	} else {
+		if (bh_urbs)
+			eie->urb_work_misses++;
+		err = refill_playback_urb(epu, &elapsed);
+		xrun = err == -EPIPE;
+	}
+	if (err < 0 && !xrun)
+		goto err;
 
+	next->in_flight = true;
 	err = usb_submit_urb(urb, GFP_ATOMIC);
 	if (err < 0) {
-		dev_err(&eie->udev->dev, "Cannot resubmit play urb.");
-		abort = true;
+		next->in_flight = false;
+		goto err;
 	}
+	eie->play_in_flight++;
+	err = add_playback_urbs(eie, &elapsed, &xrun);
 err:
+	flight_record(eie, FLIGHT_PLAY, err, next->queued,
+		urb->number_of_packets);
+	aggr_elapsed = eie->aggr_elapsed;
+	eie->aggr_elapsed = NULL;
 	spin_unlock_irqrestore(&eie->lock, flags);
-	if (elapsed)
-		snd_pcm_period_elapsed(eie->play_substream);
-	if (abort)
-		abort_playback(eie);
+	notify_playback(eie, elapsed, xrun, aggr_elapsed);
+	if (err < 0)
+		stream_error(eie, "cannot resubmit play urb");
+	if (bh_urbs)
+		queue_work(system_highpri_wq, &eie->urb_work);
 }
 
 static void sync_urb_complete(struct urb *urb)
 {
 	struct eie *eie = urb->context;
+	unsigned int frames = 0;
 	int i;
 	int err;
 
@@ -832,80 +2505,594 @@ static void sync_urb_complete(struct urb *urb)
 	if (urb->status != 0) {
 		dev_dbg(&eie->udev->dev, "Sync urb complete. status = %d, packets = %d",
 			urb->status, urb->number_of_packets);
+		flight_record(eie, FLIGHT_SYNC, urb->status, 0,
+			urb->number_of_packets);
+		return;
+	}
+
+	WRITE_ONCE(eie->sync_active, ktime_get());
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		unsigned int len = urb->iso_frame_desc[i].actual_length;
+		unsigned char *buf = urb->transfer_buffer
+			+ urb->iso_frame_desc[i].offset;
+		unsigned int d;
+
+		if (len == 0) {
+			eie->clock_missed++;
+			eie->clock_hist[eie->clock_hist_pos % CLOCK_HIST] = 0;
+			WRITE_ONCE(eie->clock_hist_pos, eie->clock_hist_pos + 1);
+			continue;
+		}
+
+		/* the device did not advance clock */
+		if (buf[0] != 0)
+			eie->clock_glitches = 0;
+		else if (++eie->clock_glitches == CLOCK_GLITCH_LIMIT)
+			stream_error(eie, "clock stopped");
+
+		/* the 2nd and 3rd byte repeat the counts of lost packets */
+		d = buf[0];
+		if (eie->clock_missed >= 1 && len >= 2) {
+			eie->clock_hist[(eie->clock_hist_pos - 1) % CLOCK_HIST] = buf[1];
+			d += buf[1];
+		}
+		if (eie->clock_missed >= 2 && len >= 3) {
+			eie->clock_hist[(eie->clock_hist_pos - 2) % CLOCK_HIST] = buf[2];
+			d += buf[2];
+		}
+		eie->clock_missed = 0;
+		eie->clock_hist[eie->clock_hist_pos % CLOCK_HIST] = buf[0];
+		WRITE_ONCE(eie->clock_hist_pos, eie->clock_hist_pos + 1);
+
+		atomic_add(d, &eie->frames_elapsed);
+		if (READ_ONCE(eie->aggr_running))
+			atomic64_add(d, &eie->aggr_clock);
+		frames += d;
+	}
+
+	if (frames && test_bit(LOOPBACK_RUNNING, &eie->states)
+		&& loopback_played(eie, frames))
+		snd_pcm_period_elapsed(eie->loop_substream);
+
+	err = usb_submit_urb(urb, GFP_ATOMIC);
+	flight_record(eie, FLIGHT_SYNC, err, frames, urb->number_of_packets);
+	if (err < 0)
+		stream_error(eie, "cannot resubmit sync urb");
+}
+
+/* Decodes one captured frame. Returns 1 when it went to the capture buffer. */
+static inline unsigned int capture_frame(struct eie *eie, const u8 *in,
+	struct snd_pcm_runtime *runtime, bool monitor)
+{
+	struct eie_meter *m = &eie->cap_meter;
+	__le32 *out;
+	u32 ch[4];
+
+	eie_decode_frame(in, ch);
+
+	/* the monitor gets the frames dropped for the linked start too */
+	if (monitor)
+		monitor_put(eie, ch);
+
+	if (!runtime)
+		return 0;
+	if (eie->cap_skip) {
+		eie->cap_skip--;
+		return 0;
+	}
+
+	out = (__le32 *) (runtime->dma_area + eie->cap_buf_pos * BYTES_PER_FRAME_CAP);
+	eie->cap_buf_pos++;
+	eie->cap_buf_pos %= runtime->buffer_size;
+
+	out[0] = __cpu_to_le32(ch[0]);
+	out[1] = __cpu_to_le32(ch[1]);
+	out[2] = __cpu_to_le32(ch[2]);
+	out[3] = __cpu_to_le32(ch[3]);
+
+	/* the samples are still in registers, meter them here */
+	meter_sample(m, 0, ch[0]);
+	meter_sample(m, 1, ch[1]);
+	meter_sample(m, 2, ch[2]);
+	meter_sample(m, 3, ch[3]);
+
+	return 1;
+}
+
+/* Copies whole captured frames to the raw buffer. */
+static void raw_put(struct eie *eie, struct snd_pcm_runtime *runtime,
+	const u8 *buf, unsigned int frames)
+{
+	unsigned int part;
+
+	eie->raw_frames += frames;
+	while (frames > 0) {
+		part = min(frames, runtime->buffer_size - eie->raw_buf_pos);
+		memcpy(runtime->dma_area + eie->raw_buf_pos * EIE_CAP_FRAME_BYTES,
+			buf, part * EIE_CAP_FRAME_BYTES);
+		buf += part * EIE_CAP_FRAME_BYTES;
+		frames -= part;
+		eie->raw_buf_pos = (eie->raw_buf_pos + part) % runtime->buffer_size;
+	}
+}
+
+/*
+ * Decodes a completed capture URB and copies it to the raw capture, then
+ * reports the elapsed periods of both.
+ *
+ * The bitstream does not have to be split at frame boundaries, so the bytes
+ * of a frame left at the end of a transfer wait in cap_carry for the rest
+ * in the next one. The carry is kept up to date even when nobody listens so
+ * the stream stays aligned for a later start.
+ */
+static void decode_capture_urb(struct eie *eie, struct urb *urb)
+{
+	unsigned long flags;
+	bool elapsed = false;
+	bool raw_elapsed = false;
+	bool decode;
+	bool monitor;
+
+	const u8 *buf = urb->transfer_buffer;
+	unsigned int len = urb->actual_length;
+	unsigned int captured = 0;
+	struct snd_pcm_runtime *runtime = NULL;
+	struct snd_pcm_runtime *raw = NULL;
+	unsigned int n, i;
+
+	spin_lock_irqsave(&eie->lock, flags);
+	if (test_bit(CAPTURE_RUNNING, &eie->states))
+		runtime = eie->cap_substream->runtime;
+	if (test_bit(RAW_RUNNING, &eie->states))
+		raw = eie->raw_substream->runtime;
+	monitor = eie->mon_enabled;
+	decode = runtime || monitor;
+
+	if (eie->cap_carry_len) {
+		n = min(len, EIE_CAP_FRAME_BYTES - eie->cap_carry_len);
+		memcpy(eie->cap_carry + eie->cap_carry_len, buf, n);
+		eie->cap_carry_len += n;
+		buf += n;
+		len -= n;
+		if (eie->cap_carry_len == EIE_CAP_FRAME_BYTES) {
+			if (decode)
+				captured += capture_frame(eie, eie->cap_carry,
+					runtime, monitor);
+			if (raw)
+				raw_put(eie, raw, eie->cap_carry, 1);
+			eie->cap_carry_len = 0;
+		}
+	}
+
+	n = len / EIE_CAP_FRAME_BYTES;
+	for (i = 0; decode && i < n; i++)
+		captured += capture_frame(eie, buf + EIE_CAP_FRAME_BYTES * i,
+			runtime, monitor);
+	if (raw)
+		raw_put(eie, raw, buf, n);
+	buf += EIE_CAP_FRAME_BYTES * n;
+	len -= EIE_CAP_FRAME_BYTES * n;
+
+	if (len) {
+		memcpy(eie->cap_carry, buf, len);
+		eie->cap_carry_len = len;
+		eie->cap_carried++;
+	}
+
+	if (runtime) {
+		eie->cap_meter.frames += captured;
+		eie->cap_frames += captured;
+		elapsed = periods_elapsed(&eie->cap_frames, runtime);
+		if (elapsed)
+			meter_publish(&eie->cap_meter);
+	}
+	if (raw)
+		raw_elapsed = periods_elapsed(&eie->raw_frames, raw);
+	spin_unlock_irqrestore(&eie->lock, flags);
+
+	if (elapsed)
+		snd_pcm_period_elapsed(eie->cap_substream);
+	if (raw_elapsed)
+		snd_pcm_period_elapsed(eie->raw_substream);
+}
+
+/*
+ * Data of a failed transfer is lost and with it the position in the frame.
+ * Start over at the next transfer of the other URB, which is the best guess
+ * we have.
+ */
+static void drop_capture_carry(struct eie *eie)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&eie->lock, flags);
+	if (eie->cap_carry_len) {
+		eie->cap_carry_len = 0;
+		eie->cap_realigns++;
+		dev_dbg(&eie->udev->dev, "Capture realigned.");
+	}
+	spin_unlock_irqrestore(&eie->lock, flags);
+}
+
+static unsigned int cap_urb_index(struct eie *eie, struct urb *urb)
+{
+	unsigned int i;
+
+	for (i = 0; i < CAP_URB_CNT - 1; i++)
+		if (eie->cap_urbs[i] == urb)
+			break;
+	return i;
+}
+
+/*
+ * Remembers an URB that is not in flight any more while the capture URBs
+ * should run. The restart brings it back, as does submit_cap_urbs() when
+ * the restart is not possible.
+ */
+static void lose_capture_urb(struct eie *eie, struct urb *urb,
+	const char *what)
+{
+	set_bit(cap_urb_index(eie, urb), &eie->cap_lost);
+	stream_error(eie, what);
+}
+
+/*
+ * Sends the URB again unless the capture URBs are being stopped. A failed
+ * transfer is retried too, a run of them restarts the streams.
+ */
+static void resubmit_capture_urb(struct eie *eie, struct urb *urb,
+	bool failed, gfp_t mem_flags)
+{
+	if (!test_bit(CAPTURE_URBS, &eie->states))
+		return;
+
+	if (!failed) {
+		WRITE_ONCE(eie->cap_errors, 0);
+	} else if (READ_ONCE(eie->cap_errors) >= CAP_ERROR_LIMIT) {
+		lose_capture_urb(eie, urb, "capture transfers fail");
+		return;
+	} else {
+		WRITE_ONCE(eie->cap_errors, eie->cap_errors + 1);
+	}
+
+	if (usb_submit_urb(urb, mem_flags) < 0)
+		lose_capture_urb(eie, urb, "cannot resubmit capture urb");
+}
+
+static void cap_urb_complete(struct urb *urb)
+{
+	struct eie *eie = urb->context;
+	bool failed = false;
+	unsigned int i;
+
+	flight_record(eie, FLIGHT_CAP, urb->status,
+		urb->actual_length / EIE_CAP_FRAME_BYTES,
+		urb->actual_length % EIE_CAP_FRAME_BYTES);
+
+	if (urb->status != 0) {
+		dev_dbg(&eie->udev->dev, "Capture urb complete. %d", urb->status);
+		/* unlinked or the device is gone */
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET
+			|| urb->status == -ESHUTDOWN || urb->status == -ENODEV)
+			return;
+		failed = true;
+	} else {
+		WRITE_ONCE(eie->cap_active, ktime_get());
+	}
+
+	/* the URB work decodes and resubmits it in its turn */
+	if (bh_urbs) {
+		i = cap_urb_index(eie, urb);
+		if (failed)
+			set_bit(i, &eie->cap_failed);
+		set_bit(i, &eie->cap_pending);
+		queue_work(system_highpri_wq, &eie->urb_work);
 		return;
 	}
 
-	for (i = 0; i < urb->number_of_packets; i++) {
-		if (urb->iso_frame_desc[i].actual_length > 0) {
-			unsigned char *buf = urb->transfer_buffer;
-			unsigned int offset = urb->iso_frame_desc[i].offset;
-			unsigned char d = buf[offset];
-
-			if (d == 0) {
-				/* the device did not advance clock */
-				abort_playback(eie);
-			}
-			atomic_add(d, &eie->frames_elapsed);
-		}
-	}
+	if (failed)
+		drop_capture_carry(eie);
+	else
+		decode_capture_urb(eie, urb);
+	resubmit_capture_urb(eie, urb, failed, GFP_ATOMIC);
+}
+
+/*
+ * Fills the spare playback URB and decodes the pending capture URBs, at most
+ * URB_WORK_BUDGET of them per run so other high priority work gets its turn.
+ */
+static void eie_urb_work(struct work_struct *work)
+{
+	struct eie *eie = container_of(work, struct eie, urb_work);
+	struct snd_pcm_substream *aggr_elapsed = NULL;
+	unsigned int budget = URB_WORK_BUDGET;
+	bool elapsed = false;
+	bool xrun = false;
+	bool failed;
+	struct urb *urb;
+	int err = 0;
+
+	spin_lock_irq(&eie->lock);
+	if (eie->play_spare && !eie->play_spare_filled) {
+		err = refill_playback_urb(eie->play_spare, &elapsed);
+		xrun = err == -EPIPE;
+		if (err == 0 || xrun)
+			eie->play_spare_filled = true;
+		budget--;
+	}
+	aggr_elapsed = eie->aggr_elapsed;
+	eie->aggr_elapsed = NULL;
+	spin_unlock_irq(&eie->lock);
+	notify_playback(eie, elapsed, xrun, aggr_elapsed);
+	if (err < 0 && !xrun)
+		stream_error(eie, "cannot fill play urb");
+
+	/* in the order of completion, a frame may continue in the next URB */
+	while (budget > 0 && test_and_clear_bit(eie->cap_next, &eie->cap_pending)) {
+		urb = eie->cap_urbs[eie->cap_next];
+		failed = test_and_clear_bit(eie->cap_next, &eie->cap_failed);
+		eie->cap_next = (eie->cap_next + 1) % CAP_URB_CNT;
+		if (failed)
+			drop_capture_carry(eie);
+		else
+			decode_capture_urb(eie, urb);
+		budget--;
+		resubmit_capture_urb(eie, urb, failed, GFP_KERNEL);
+	}
+
+	if (test_bit(eie->cap_next, &eie->cap_pending))
+		queue_work(system_highpri_wq, &eie->urb_work);
+}
+
+static int eie_link_offset_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = INT_MAX;
+	return 0;
+}
+
+static int eie_link_offset_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = READ_ONCE(eie->link_offset);
+	return 0;
+}
+
+/*
+ * Number of device frames between the linked start and the first played
+ * frame, i.e. how many captured frames were dropped to align the streams.
+ * It is the playback queued in the URBs at the trigger less the part the
+ * controller already sent, estimated from the time since the last playback
+ * completion. It is not a measured round trip: the converter latency of
+ * both directions and the delay of the capture transfers are not included.
+ * Capture frame n holds what the device recorded while playing playback
+ * frame n, shifted by that constant, which a loopback cable measures once,
+ * and by the error of the estimate, the completion latency of the host.
+ */
+static const struct snd_kcontrol_new eie_link_offset_ctl = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.name = "Linked Start Offset",
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info = eie_link_offset_info,
+	.get = eie_link_offset_get,
+};
+
+static int eie_play_start_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER64;
+	uinfo->count = 2;
+	uinfo->value.integer64.min = 0;
+	uinfo->value.integer64.max = LLONG_MAX;
+	return 0;
+}
+
+static int eie_play_start_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+
+	spin_lock_irq(&eie->lock);
+	ucontrol->value.integer64.value[0] = eie->play_start;
+	ucontrol->value.integer64.value[1] =
+		eie->play_start - eie->play_trigger_pos;
+	spin_unlock_irq(&eie->lock);
+	return 0;
+}
+
+/*
+ * The frame of the last playback start, counted in frames sent to the
+ * device since its URBs were started, and the frames between the one
+ * being sent at the trigger and the start, i.e. the start latency.
+ */
+static const struct snd_kcontrol_new eie_play_start_ctl = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.name = "Playback Start Frame",
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info = eie_play_start_info,
+	.get = eie_play_start_get,
+};
+
+static int eie_cap_align_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 2;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = INT_MAX;
+	return 0;
+}
+
+static int eie_cap_align_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+
+	spin_lock_irq(&eie->lock);
+	ucontrol->value.integer.value[0] = eie->cap_carried;
+	ucontrol->value.integer.value[1] = eie->cap_realigns;
+	spin_unlock_irq(&eie->lock);
+	return 0;
+}
+
+/*
+ * The capture transfers that ended inside a frame, completed by the next
+ * one, and the times the frame position was lost with a failed transfer.
+ */
+static const struct snd_kcontrol_new eie_cap_align_ctl = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.name = "Capture Alignment Events",
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info = eie_cap_align_info,
+	.get = eie_cap_align_get,
+};
 
-	err = usb_submit_urb(urb, GFP_ATOMIC);
-	if (err < 0)
-		abort_playback(eie);
+#define METER_RMS 1
+#define METER_PLAYBACK 2
+
+static int eie_meter_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 4;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = 0x7fffff;
+	return 0;
 }
 
-static void cap_urb_complete(struct urb *urb)
+/* Each read returns the level of the last elapsed period. */
+static int eie_meter_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
 {
-	struct eie *eie = urb->context;
-	int err;
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+	unsigned long which = kcontrol->private_value;
+	struct eie_meter *m = which & METER_PLAYBACK ?
+		&eie->play_meter : &eie->cap_meter;
+	unsigned int ch;
+
+	spin_lock_irq(&eie->lock);
+	for (ch = 0; ch < 4; ch++)
+		ucontrol->value.integer.value[ch] = which & METER_RMS ?
+			m->last_rms[ch] : m->last_peak[ch];
+	spin_unlock_irq(&eie->lock);
 
-	if (urb->status != 0) {
-		dev_dbg(&eie->udev->dev, "Capture urb complete. %d", urb->status);
-		return;
-	}
+	return 0;
+}
 
-	/* TODO: write ALSA part & implement (spin)locking */
-	if (test_bit(CAPTURE_RUNNING, &eie->states)) {
+#define EIE_METER(xname, xwhich) { \
+	.iface = SNDRV_CTL_ELEM_IFACE_MIXER, \
+	.name = xname, \
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE, \
+	.info = eie_meter_info, \
+	.get = eie_meter_get, \
+	.private_value = xwhich, \
+}
 
-		unsigned int ch1, ch2, ch3, ch4;
-		unsigned int i, j;
-		unsigned char *buf = urb->transfer_buffer;
-		unsigned int frames_rcvd = urb->actual_length / 64;
-		bool elapsed;
-		struct snd_pcm_runtime *runtime = eie->cap_substream->runtime;
+static const struct snd_kcontrol_new eie_meter_ctls[] = {
+	EIE_METER("Capture Peak Level", 0),
+	EIE_METER("Capture RMS Level", METER_RMS),
+	EIE_METER("Playback Peak Level", METER_PLAYBACK),
+	EIE_METER("Playback RMS Level", METER_PLAYBACK | METER_RMS),
+};
 
-		for (i = 0; i < frames_rcvd; i++) {
-			__le32 *out = (__le32 *) (runtime->dma_area + eie->cap_buf_pos * BYTES_PER_FRAME_CAP);
+static int eie_monitor_switch_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
 
-			eie->cap_buf_pos++;
-			eie->cap_buf_pos %= runtime->buffer_size;
+	ucontrol->value.integer.value[0] = READ_ONCE(eie->mon_enabled);
+	return 0;
+}
 
-			ch1 = ch2 = ch3 = ch4 = 0;
-			for (j = 0; j < 24; j++) {
-				ch1 |= (buf[64*i + j +  0]        & 1) << (23-j);
-				ch2 |= (buf[64*i + j + 32]        & 1) << (23-j);
-				ch3 |= ((buf[64*i + j +  0] >> 1) & 1) << (23-j);
-				ch4 |= ((buf[64*i + j + 32] >> 1) & 1) << (23-j);
-			}
-			out[0] = __cpu_to_le32(ch1);
-			out[1] = __cpu_to_le32(ch2);
-			out[2] = __cpu_to_le32(ch3);
-			out[3] = __cpu_to_le32(ch4);
-		}
+static int eie_monitor_switch_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+	bool enable = ucontrol->value.integer.value[0];
+	int changed;
+
+	spin_lock_irq(&eie->lock);
+	changed = eie->mon_enabled != enable;
+	if (changed && enable)
+		eie->mon_rd = eie->mon_wr;
+	eie->mon_enabled = enable;
+	spin_unlock_irq(&eie->lock);
+
+	/* the monitor needs the captured frames */
+	if (changed)
+		update_capture_urbs(eie);
+
+	return changed;
+}
 
-		eie->cap_frames += frames_rcvd;
-		elapsed = eie->cap_frames > runtime->period_size;
-		if (elapsed) {
-			eie->cap_frames = 0;
-			snd_pcm_period_elapsed(eie->cap_substream);
-		}
+static int eie_monitor_gain_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 4;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = MON_GAIN_UNITY;
+	return 0;
+}
+
+static int eie_monitor_gain_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+	unsigned int ch;
+
+	for (ch = 0; ch < 4; ch++)
+		ucontrol->value.integer.value[ch] = READ_ONCE(eie->mon_gain[ch]);
+	return 0;
+}
+
+static int eie_monitor_gain_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *eie = snd_kcontrol_chip(kcontrol);
+	unsigned int gain;
+	unsigned int ch;
+	int changed = 0;
+
+	spin_lock_irq(&eie->lock);
+	for (ch = 0; ch < 4; ch++) {
+		gain = clamp_t(long, ucontrol->value.integer.value[ch],
+			0, MON_GAIN_UNITY);
+		changed |= eie->mon_gain[ch] != gain;
+		eie->mon_gain[ch] = gain;
 	}
+	spin_unlock_irq(&eie->lock);
 
-	err = usb_submit_urb(urb, GFP_ATOMIC);
-	if (err < 0)
-		abort_playback(eie);
+	return changed;
 }
 
+/*
+ * Input n is mixed into output n right when the playback URB is filled, so
+ * the monitor latency is that of the in-flight playback URBs only.
+ */
+static const struct snd_kcontrol_new eie_monitor_ctls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Monitor Playback Switch",
+		.info = snd_ctl_boolean_mono_info,
+		.get = eie_monitor_switch_get,
+		.put = eie_monitor_switch_put,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Monitor Playback Volume",
+		.info = eie_monitor_gain_info,
+		.get = eie_monitor_gain_get,
+		.put = eie_monitor_gain_put,
+	},
+};
+
 static void min_urb_complete(struct urb *urb)
 {
 	struct eie *eie = urb->context;
@@ -950,6 +3137,29 @@ static void kill_all_urbs(struct eie *eie)
 	struct urb *urb;
 	int i;
 
+	hrtimer_cancel(&eie->watchdog);
+	mutex_lock(&eie->cap_mutex);
+	clear_bit(CAPTURE_URBS, &eie->states);
+
+	/* unlink everything first so the waits below overlap */
+	for (i = 0; i < PLAY_URB_CNT; i++) {
+		urb = eie->play_urbs[i].urb;
+		if (urb)
+			usb_unlink_urb(urb);
+	}
+
+	for (i = 0; i < SYNC_URB_CNT; i++) {
+		urb = eie->sync_urbs[i];
+		if (urb)
+			usb_unlink_urb(urb);
+	}
+
+	for (i = 0; i < CAP_URB_CNT; i++) {
+		urb = eie->cap_urbs[i];
+		if (urb)
+			usb_unlink_urb(urb);
+	}
+
 	for (i = 0; i < PLAY_URB_CNT; i++) {
 		urb = eie->play_urbs[i].urb;
 		if (urb)
@@ -967,6 +3177,112 @@ static void kill_all_urbs(struct eie *eie)
 		if (urb)
 			usb_kill_urb(urb);
 	}
+
+	/* the URB work may have resubmitted a capture URB meanwhile */
+	cancel_work_sync(&eie->urb_work);
+	for (i = 0; i < CAP_URB_CNT; i++) {
+		urb = eie->cap_urbs[i];
+		if (urb)
+			usb_kill_urb(urb);
+	}
+	eie->cap_pending = 0;
+	eie->cap_failed = 0;
+	eie->cap_errors = 0;
+	eie->cap_lost = 0;
+	eie->cap_next = 0;
+	eie->clock_hist_pos = 0;
+	eie->clock_missed = 0;
+	eie->cap_carry_len = 0;
+	eie->play_spare = NULL;
+
+	clear_bit(URBS_FLOWING, &eie->states);
+	eie->sync_active = 0;
+	eie->play_active = 0;
+	eie->cap_active = 0;
+	mutex_unlock(&eie->cap_mutex);
+}
+
+static bool capture_wanted(struct eie *eie)
+{
+	return READ_ONCE(eie->stream_rate[SNDRV_PCM_STREAM_CAPTURE])
+		|| READ_ONCE(eie->stream_rate[SLOT_RAW])
+		|| READ_ONCE(eie->mon_enabled);
+}
+
+/* Kills the capture URBs alone, the other streams keep running. */
+static void kill_cap_urbs(struct eie *eie)
+{
+	int i;
+
+	clear_bit(CAPTURE_URBS, &eie->states);
+	for (i = 0; i < CAP_URB_CNT; i++)
+		usb_kill_urb(eie->cap_urbs[i]);
+
+	/* the URB work may have resubmitted one before it saw the bit */
+	cancel_work_sync(&eie->urb_work);
+	for (i = 0; i < CAP_URB_CNT; i++)
+		usb_kill_urb(eie->cap_urbs[i]);
+
+	spin_lock_irq(&eie->lock);
+	eie->cap_pending = 0;
+	eie->cap_failed = 0;
+	eie->cap_errors = 0;
+	eie->cap_lost = 0;
+	eie->cap_next = 0;
+	eie->cap_carry_len = 0;
+	spin_unlock_irq(&eie->lock);
+	eie->cap_active = 0;
+
+	/* it may have had the spare playback URB to fill */
+	if (bh_urbs)
+		queue_work(system_highpri_wq, &eie->urb_work);
+}
+
+/* Submits the capture URBs if wanted, with the other streams flowing. */
+static int submit_cap_urbs(struct eie *eie)
+{
+	unsigned long todo = BIT(CAP_URB_CNT) - 1;
+	int err = 0;
+	int i;
+
+	mutex_lock(&eie->cap_mutex);
+	if (!capture_wanted(eie) || !test_bit(URBS_FLOWING, &eie->states))
+		goto out;
+	/* running already, bring back the URBs a failure left behind */
+	if (test_and_set_bit(CAPTURE_URBS, &eie->states))
+		todo = xchg(&eie->cap_lost, 0);
+
+	for (i = 0; i < CAP_URB_CNT; i++) {
+		if (!(todo & BIT(i)))
+			continue;
+		err = usb_submit_urb(eie->cap_urbs[i], GFP_NOIO);
+		if (err < 0) {
+			dev_err(&eie->udev->dev, "Cannot submit capture urb: %s",
+				usb_error_string(err));
+			kill_cap_urbs(eie);
+			break;
+		}
+	}
+out:
+	mutex_unlock(&eie->cap_mutex);
+	return err;
+}
+
+/*
+ * The capture URBs run only while a capture substream, decoded or raw, is
+ * prepared or the monitor is on, so a playback alone does not poll the
+ * bulk endpoint.
+ */
+static int update_capture_urbs(struct eie *eie)
+{
+	if (capture_wanted(eie))
+		return submit_cap_urbs(eie);
+
+	mutex_lock(&eie->cap_mutex);
+	if (test_bit(CAPTURE_URBS, &eie->states))
+		kill_cap_urbs(eie);
+	mutex_unlock(&eie->cap_mutex);
+	return 0;
 }
 
 static void kill_and_free_urb(struct eie *eie, struct urb **urbp)
@@ -989,6 +3305,8 @@ static void free_usb_related_resources(struct eie *eie)
 {
 	int i;
 
+	kill_all_urbs(eie);
+
 	for (i = 0; i < PLAY_URB_CNT; i++)
 		kill_and_free_urb(eie, &eie->play_urbs[i].urb);
 
@@ -1262,6 +3580,186 @@ static int init_urbs(struct eie *eie)
 	return 0;
 }
 
+static int eie_aggr_drift_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = AGGR_MAX_UNITS;
+	uinfo->value.integer.min = -1000000;
+	uinfo->value.integer.max = 1000000;
+	return 0;
+}
+
+/* clock drift of each unit against the master in ppm */
+static int eie_aggr_drift_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct eie *unit;
+	s64 master_frames;
+	unsigned int i;
+
+	spin_lock_irq(&eie_aggr.lock);
+	master_frames = eie_aggr.units[0] ?
+		atomic64_read(&eie_aggr.units[0]->aggr_clock) : 0;
+	for (i = 0; i < AGGR_MAX_UNITS; i++) {
+		unit = eie_aggr.units[i];
+		ucontrol->value.integer.value[i] = 0;
+		if (unit && i < eie_aggr.active && master_frames > 0)
+			ucontrol->value.integer.value[i] = div64_s64(
+				unit->aggr_drift * 1000000 / 256, master_frames);
+	}
+	spin_unlock_irq(&eie_aggr.lock);
+
+	return 0;
+}
+
+static const struct snd_kcontrol_new eie_aggr_drift_ctl = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.device = 1,
+	.name = "Aggregate Drift PPM",
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info = eie_aggr_drift_info,
+	.get = eie_aggr_drift_get,
+};
+
+/* The first unit gets the aggregate PCM as device 1 of its card. */
+static int aggr_attach(struct eie *eie)
+{
+	struct snd_pcm *pcm;
+	unsigned int slot;
+	int err = 0;
+
+	mutex_lock(&eie_aggr.mutex);
+
+	for (slot = 0; slot < AGGR_MAX_UNITS; slot++)
+		if (!eie_aggr.units[slot])
+			break;
+	/* a new master needs the old aggregate PCM to be closed first */
+	if (slot == AGGR_MAX_UNITS || (slot == 0 && eie_aggr.substream)) {
+		dev_warn(&eie->udev->dev, "Cannot join the aggregate PCM.");
+		goto out;
+	}
+
+	if (slot == 0) {
+		err = snd_pcm_new(eie->card, "EIE pro aggregate", 1, 1, 0, &pcm);
+		if (err < 0)
+			goto out;
+		pcm->private_data = eie;
+		strscpy(pcm->name, "EIE pro aggregate");
+		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK,
+			&eie_aggregate_pcm_ops);
+		err = snd_pcm_set_managed_buffer(
+			pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream,
+			SNDRV_DMA_TYPE_VMALLOC, NULL,
+			eie_aggregate_hw.buffer_bytes_max,
+			eie_aggregate_hw.buffer_bytes_max);
+		if (err < 0)
+			goto out;
+
+		err = snd_ctl_add(eie->card, snd_ctl_new1(&eie_aggr_drift_ctl, eie));
+		if (err < 0)
+			goto out;
+	}
+
+	spin_lock_irq(&eie_aggr.lock);
+	eie_aggr.units[slot] = eie;
+	eie->aggr_slot = slot;
+	eie->aggr_member = true;
+	spin_unlock_irq(&eie_aggr.lock);
+out:
+	mutex_unlock(&eie_aggr.mutex);
+	return err;
+}
+
+static void aggr_detach(struct eie *eie)
+{
+	struct snd_pcm_substream *substream;
+
+	if (!eie->aggr_member)
+		return;
+
+	mutex_lock(&eie_aggr.mutex);
+
+	substream = eie_aggr.substream;
+	if (substream && eie->aggr_slot < eie_aggr.active)
+		xrun_substream(substream);
+
+	spin_lock_irq(&eie_aggr.lock);
+	eie_aggr.units[eie->aggr_slot] = NULL;
+	eie->aggr_running = false;
+	eie->aggr_member = false;
+	spin_unlock_irq(&eie_aggr.lock);
+
+	mutex_unlock(&eie_aggr.mutex);
+}
+
+static const char * const flight_kinds[] = {
+	[FLIGHT_SYNC] = "sync",
+	[FLIGHT_PLAY] = "play",
+	[FLIGHT_CAP] = "cap",
+};
+
+/* Lists the recorded completions, oldest first, timed from the freeze. */
+static int eie_flight_show(struct seq_file *m, void *v)
+{
+	struct eie *eie = m->private;
+	struct eie_flight *fr = &eie->flight;
+	const char *reason = READ_ONCE(fr->reason);
+	unsigned int head = atomic_read(&fr->head);
+	unsigned int i = head > FLIGHT_ENTRIES ? head - FLIGHT_ENTRIES : 0;
+	ktime_t end = reason ? fr->frozen_at : ktime_get();
+	struct eie_flight_entry *e;
+
+	seq_printf(m, "%s\n", reason ? reason : "recording");
+	seq_puts(m, "      time_us kind  status frames aux\n");
+	for (; i != head; i++) {
+		e = &fr->entries[i & (FLIGHT_ENTRIES - 1)];
+		seq_printf(m, "%13lld %-4s %7d %6u %3u\n",
+			ktime_us_delta(e->time, end), flight_kinds[e->kind],
+			e->status, e->frames, e->aux);
+	}
+	return 0;
+}
+
+static int eie_flight_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, eie_flight_show, inode->i_private);
+}
+
+/* Any write rearms the recorder. */
+static ssize_t eie_flight_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct eie *eie = m->private;
+
+	WRITE_ONCE(eie->flight.reason, NULL);
+	atomic_set(&eie->flight.frozen, 0);
+	return count;
+}
+
+static const struct file_operations eie_flight_fops = {
+	.owner = THIS_MODULE,
+	.open = eie_flight_open,
+	.read = seq_read,
+	.write = eie_flight_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void eie_card_free(struct snd_card *card)
+{
+	struct eie *eie = card->private_data;
+
+	/* stream_error() may have queued it again while disconnecting */
+	cancel_work_sync(&eie->recovery_work);
+	cancel_work_sync(&eie->urb_work);
+	usb_put_intf(eie->ifa);
+	mutex_lock(&devices_mutex);
+	clear_bit(eie->card_index, devices_used);
+	mutex_unlock(&devices_mutex);
+}
+
 static int eie_probe(struct usb_interface *interface,
 	const struct usb_device_id *usb_id)
 {
@@ -1270,38 +3768,63 @@ static int eie_probe(struct usb_interface *interface,
 	unsigned int card_index;
 	struct snd_card *card;
 	struct snd_rawmidi *rmidi;
+	struct snd_pcm_substream *loop;
+	struct snd_pcm_substream *raw;
 	struct eie *eie;
 
 	char usb_path[32];
+	char debugfs_name[24];
 
+	unsigned int i;
 	int err;
 
 	mutex_lock(&devices_mutex);
-
 	for (card_index = 0; card_index < SNDRV_CARDS; ++card_index)
-		if (enable[card_index] && !(devices_used & (1 << card_index)))
+		if (enable[card_index] && !test_bit(card_index, devices_used))
 			break;
-	if (card_index >= SNDRV_CARDS) {
-		mutex_unlock(&devices_mutex);
+	if (card_index < SNDRV_CARDS)
+		set_bit(card_index, devices_used);
+	mutex_unlock(&devices_mutex);
+
+	if (card_index >= SNDRV_CARDS)
 		return -ENOENT;
-	}
+
 	err = snd_card_new(&interface_to_usbdev(interface)->dev, index[card_index], id[card_index], THIS_MODULE,
 			      sizeof(*eie), &card);
 	if (err < 0) {
+		mutex_lock(&devices_mutex);
+		clear_bit(card_index, devices_used);
 		mutex_unlock(&devices_mutex);
 		return err;
 	}
 
-	/* card->private_free = eie_card_free; */
+	/* from now on the slot is released when the card is freed */
 	eie = card->private_data;
+	eie->card_index = card_index;
+	card->private_free = eie_card_free;
 	eie->udev = interface_to_usbdev(interface);
 	eie->card = card;
-	eie->card_index = card_index;
 
 	spin_lock_init(&eie->lock);
+	mutex_init(&eie->cap_mutex);
+	mutex_init(&eie->reset_mutex);
 	init_waitqueue_head(&eie->urbs_flow_wait);
+	INIT_WORK(&eie->recovery_work, eie_recovery_work);
+	INIT_WORK(&eie->urb_work, eie_urb_work);
+	eie->play_pkts = PLAY_PKT_CNT;
+	eie->play_urbs_wanted = PLAY_URBS_IN_FLIGHT_MIN;
+	for (i = 0; i < 4; i++)
+		eie->mon_gain[i] = MON_GAIN_UNITY;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+	hrtimer_init(&eie->watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	eie->watchdog.function = eie_watchdog;
+#else
+	hrtimer_setup(&eie->watchdog, eie_watchdog, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL);
+#endif
 
-	eie->ifa = interface;
+	/* substreams closed after the disconnect still put their autopm */
+	eie->ifa = usb_get_intf(interface);
 	eie->ifb = usb_ifnum_to_if(eie->udev, 1);
 	if (!eie->ifb) {
 		err = -ENXIO;
@@ -1329,13 +3852,44 @@ static int eie_probe(struct usb_interface *interface,
 		 "Akai EIE pro, at %s, %s speed", usb_path,
 		 eie->udev->speed == USB_SPEED_HIGH ? "high" : "full");
 
-	err = snd_pcm_new(card, name, 0, 1, 1, &eie->pcm);
+	/*
+	 * The second capture substream is the playback loopback, the third
+	 * the raw capture.
+	 */
+	err = snd_pcm_new(card, name, 0, 1, 3, &eie->pcm);
 	if (err < 0)
 		goto probe_err;
 	eie->pcm->private_data = eie;
 	strscpy(eie->pcm->name, name);
 	snd_pcm_set_ops(eie->pcm, SNDRV_PCM_STREAM_PLAYBACK, &eie_playback_pcm_ops);
 	snd_pcm_set_ops(eie->pcm, SNDRV_PCM_STREAM_CAPTURE, &eie_capture_pcm_ops);
+	err = snd_pcm_set_managed_buffer(
+		eie->pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream,
+		SNDRV_DMA_TYPE_VMALLOC, NULL,
+		PLAY_BUFFER_BYTES_MAX_32, PLAY_BUFFER_BYTES_MAX_32);
+	if (err < 0)
+		goto probe_err;
+	err = snd_pcm_set_managed_buffer(
+		eie->pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream,
+		SNDRV_DMA_TYPE_VMALLOC, NULL,
+		CAP_BUFFER_BYTES_MAX, CAP_BUFFER_BYTES_MAX);
+	if (err < 0)
+		goto probe_err;
+	loop = eie->pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream->next;
+	loop->ops = &eie_loopback_pcm_ops;
+	strscpy(loop->name, "Playback Loopback");
+	/* rarely used, their buffers are allocated by hw_params, not here */
+	err = snd_pcm_set_managed_buffer(loop, SNDRV_DMA_TYPE_VMALLOC, NULL,
+		0, PLAY_BUFFER_BYTES_MAX);
+	if (err < 0)
+		goto probe_err;
+	raw = loop->next;
+	raw->ops = &eie_raw_pcm_ops;
+	strscpy(raw->name, "Capture Raw");
+	err = snd_pcm_set_managed_buffer(raw, SNDRV_DMA_TYPE_VMALLOC, NULL,
+		0, RAW_BUFFER_BYTES_MAX);
+	if (err < 0)
+		goto probe_err;
 
 	err = snd_rawmidi_new(card, "eiepro", 0, 1, 1, &rmidi);
 	if (err < 0)
@@ -1351,22 +3905,58 @@ static int eie_probe(struct usb_interface *interface,
 
 	eie->rmidi = rmidi;
 
-	err = snd_card_register(card);
+	err = snd_ctl_add(card, snd_ctl_new1(&eie_link_offset_ctl, eie));
+	if (err < 0)
+		goto probe_err;
+
+	err = snd_ctl_add(card, snd_ctl_new1(&eie_cap_align_ctl, eie));
 	if (err < 0)
 		goto probe_err;
 
-	init_urbs(eie);
+	err = snd_ctl_add(card, snd_ctl_new1(&eie_play_start_ctl, eie));
+	if (err < 0)
+		goto probe_err;
 
-	usb_set_intfdata(interface, eie);
-	devices_used |= 1 << card_index;
+	for (i = 0; i < ARRAY_SIZE(eie_meter_ctls); i++) {
+		err = snd_ctl_add(card, snd_ctl_new1(&eie_meter_ctls[i], eie));
+		if (err < 0)
+			goto probe_err;
+	}
 
-	mutex_unlock(&devices_mutex);
+	for (i = 0; i < ARRAY_SIZE(eie_monitor_ctls); i++) {
+		err = snd_ctl_add(card, snd_ctl_new1(&eie_monitor_ctls[i], eie));
+		if (err < 0)
+			goto probe_err;
+	}
+
+	err = init_urbs(eie);
+	if (err < 0)
+		goto probe_err;
+
+	snprintf(debugfs_name, sizeof(debugfs_name), "snd-eie-card%d",
+		card->number);
+	eie->debugfs = debugfs_create_dir(debugfs_name, NULL);
+	debugfs_create_file("flight", 0600, eie->debugfs, eie,
+		&eie_flight_fops);
+
+	if (aggregate) {
+		err = aggr_attach(eie);
+		if (err < 0)
+			goto probe_err;
+	}
+
+	err = snd_card_register(card);
+	if (err < 0)
+		goto probe_err;
+
+	usb_set_intfdata(interface, eie);
 	return 0;
 
 probe_err:
+	debugfs_remove_recursive(eie->debugfs);
+	aggr_detach(eie);
 	free_usb_related_resources(eie);
 	snd_card_free(card);
-	mutex_unlock(&devices_mutex);
 	return err;
 }
 
@@ -1377,17 +3967,93 @@ static void eie_disconnect(struct usb_interface *interface)
 	if (!eie)
 		return;
 
-	mutex_lock(&devices_mutex);
-
 	set_bit(DISCONNECTED, &eie->states);
 	wake_up(&eie->urbs_flow_wait);
-
+	hrtimer_cancel(&eie->watchdog);
+	cancel_work_sync(&eie->recovery_work);
+
+	debugfs_remove_recursive(eie->debugfs);
+	aggr_detach(eie);
+	snd_card_disconnect(eie->card);
+	/* no reset or restart may submit the URBs being freed */
+	mutex_lock(&eie->reset_mutex);
 	free_usb_related_resources(eie);
+	mutex_unlock(&eie->reset_mutex);
+	cancel_work_sync(&eie->recovery_work);
+	cancel_work_sync(&eie->urb_work);
 	snd_card_free_when_closed(eie->card);
+}
 
-	mutex_unlock(&devices_mutex);
+
+/*
+ * Both interfaces are bound to the driver; the work is done for the first
+ * one only. URBs are stopped on suspend and, if a substream is still open,
+ * the device is initialized again at the saved rate on resume so the
+ * substreams only need to be resumed or prepared. Otherwise the next
+ * prepare resets the device as usual.
+ */
+static int eie_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct eie *eie = usb_get_intfdata(intf);
+	int i;
+
+	if (!eie || intf != eie->ifa)
+		return 0;
+
+	dev_dbg(&eie->udev->dev, "Suspending.");
+
+	if (!PMSG_IS_AUTO(message))
+		snd_power_change_state(eie->card, SNDRV_CTL_POWER_D3hot);
+
+	set_bit(SUSPENDED, &eie->states);
+	cancel_work_sync(&eie->recovery_work);
+	clear_bit(RECOVERING, &eie->states);
+
+	kill_all_urbs(eie);
+	for (i = 0; i < MIN_URB_CNT; i++)
+		usb_kill_urb(eie->min_urbs[i]);
+	for (i = 0; i < MOUT_URB_CNT; i++)
+		usb_kill_urb(eie->mout_urbs[i]);
+
+	eie->suspended_rate = eie->rate;
+	eie->rate = 0;
+
+	return 0;
 }
 
+static int eie_resume(struct usb_interface *intf)
+{
+	struct eie *eie = usb_get_intfdata(intf);
+	int i, err = 0;
+
+	if (!eie || intf != eie->ifa)
+		return 0;
+
+	dev_dbg(&eie->udev->dev, "Resuming.");
+
+	clear_bit(SUSPENDED, &eie->states);
+
+	mutex_lock(&eie->reset_mutex);
+	if (eie->suspended_rate && (eie->play_substream || eie->cap_substream
+		|| eie->loop_substream || eie->raw_substream))
+		err = reset_eie(eie, eie->suspended_rate);
+	mutex_unlock(&eie->reset_mutex);
+	eie->suspended_rate = 0;
+	if (err < 0)
+		dev_err(&eie->udev->dev, "Cannot restore streams: %d", err);
+
+	if (test_bit(MIN_OPEN, &eie->states)) {
+		for (i = 0; i < MIN_URB_CNT; i++) {
+			err = usb_submit_urb(eie->min_urbs[i], GFP_NOIO);
+			if (err < 0)
+				dev_err(&eie->udev->dev, "Cannot resubmit midi-in urb.");
+		}
+	}
+
+	snd_power_change_state(eie->card, SNDRV_CTL_POWER_D0);
+
+	return 0;
+}
 
 static struct usb_device_id eie_ids[] = {
 	{ USB_DEVICE(0x09e8, 0x0010) }, /* EIE pro */
@@ -1400,8 +4066,10 @@ static struct usb_driver eie_driver = {
 	.id_table = eie_ids,
 	.probe = eie_probe,
 	.disconnect = eie_disconnect,
-	// .suspend = eie_suspend,
-	// .resume = eie_resume,
+	.suspend = eie_suspend,
+	.resume = eie_resume,
+	.reset_resume = eie_resume,
+	.supports_autosuspend = 1,
 };
 
 module_usb_driver(eie_driver);
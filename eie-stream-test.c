@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KUnit tests of the stream core shared in eie-stream.h. Built with the
+ * driver when the kernel has CONFIG_KUNIT, run by loading eie-stream-test.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+
+#include "eie-stream.h"
+
+static void eie_test_decode_frame(struct kunit *test)
+{
+	u8 in[EIE_CAP_FRAME_BYTES] = { 0 };
+	u32 ch[4];
+	unsigned int j;
+
+	/* the first and the last bit of each channel */
+	in[0] = 1;
+	in[23] = 2;
+	in[32] = 3;
+	in[55] = 1;
+	eie_decode_frame(in, ch);
+	KUNIT_EXPECT_EQ(test, ch[0], 0x800000u);
+	KUNIT_EXPECT_EQ(test, ch[1], 0x800001u);
+	KUNIT_EXPECT_EQ(test, ch[2], 0x000001u);
+	KUNIT_EXPECT_EQ(test, ch[3], 0x800000u);
+
+	/* the unused bits and bytes are ignored */
+	memset(in, 0xfc, sizeof(in));
+	eie_decode_frame(in, ch);
+	for (j = 0; j < 4; j++)
+		KUNIT_EXPECT_EQ(test, ch[j], 0u);
+
+	/* 0xa5a5a5 on channel 1, 0x5a5a5a on channel 4 */
+	memset(in, 0, sizeof(in));
+	for (j = 0; j < 24; j++) {
+		in[j] = (0xa5a5a5 >> (23 - j)) & 1;
+		in[j + 32] = ((0x5a5a5a >> (23 - j)) & 1) << 1;
+	}
+	eie_decode_frame(in, ch);
+	KUNIT_EXPECT_EQ(test, ch[0], 0xa5a5a5u);
+	KUNIT_EXPECT_EQ(test, ch[1], 0u);
+	KUNIT_EXPECT_EQ(test, ch[2], 0u);
+	KUNIT_EXPECT_EQ(test, ch[3], 0x5a5a5au);
+}
+
+static const u8 packed[EIE_PLAY_FRAME_BYTES] = {
+	0x56, 0x34, 0x12, 0xef, 0xcd, 0xab, 0x01, 0x00, 0x00, 0xba, 0xdc, 0xfe
+};
+
+static void eie_test_pack_frame(struct kunit *test)
+{
+	const u32 ch[4] = { 0x123456, 0xabcdef, 0x000001, 0xfedcba };
+	u8 out[EIE_PLAY_FRAME_BYTES];
+
+	eie_pack_frame(ch, out);
+	KUNIT_EXPECT_MEMEQ(test, out, packed, sizeof(packed));
+}
+
+static void eie_test_pack_frames32(struct kunit *test)
+{
+	/* S32_LE, the low byte is dropped */
+	const u8 s32[16] = {
+		0xff, 0x56, 0x34, 0x12, 0x80, 0xef, 0xcd, 0xab,
+		0x00, 0x01, 0x00, 0x00, 0x7f, 0xba, 0xdc, 0xfe
+	};
+	/* S24_LE, the sign extension in the high byte is dropped */
+	const u8 s24[16] = {
+		0x56, 0x34, 0x12, 0x00, 0xef, 0xcd, 0xab, 0xff,
+		0x01, 0x00, 0x00, 0x00, 0xba, 0xdc, 0xfe, 0xff
+	};
+	u8 in[2 * 16 + 1];
+	u8 out[2 * EIE_PLAY_FRAME_BYTES + 1];
+
+	memset(out, 0xaa, sizeof(out));
+	eie_pack_frames32(s32, out, 1, 8);
+	KUNIT_EXPECT_MEMEQ(test, out, packed, sizeof(packed));
+	/* nothing is written past the frames */
+	KUNIT_EXPECT_EQ(test, out[EIE_PLAY_FRAME_BYTES], 0xaa);
+
+	eie_pack_frames32(s24, out, 1, 0);
+	KUNIT_EXPECT_MEMEQ(test, out, packed, sizeof(packed));
+
+	/* frames follow each other, the input need not be aligned */
+	memcpy(in + 1, s24, 16);
+	memcpy(in + 17, s24, 16);
+	eie_pack_frames32(in + 1, out, 2, 0);
+	KUNIT_EXPECT_MEMEQ(test, out, packed, sizeof(packed));
+	KUNIT_EXPECT_MEMEQ(test, out + EIE_PLAY_FRAME_BYTES, packed,
+		sizeof(packed));
+	KUNIT_EXPECT_EQ(test, out[2 * EIE_PLAY_FRAME_BYTES], 0xaa);
+}
+
+static void eie_test_frames_nominal(struct kunit *test)
+{
+	unsigned int rem = 0;
+
+	/* 5 ms at 44.1 kHz alternates between 220 and 221 frames */
+	KUNIT_EXPECT_EQ(test, eie_frames_nominal(44100, 40, &rem), 220u);
+	KUNIT_EXPECT_EQ(test, eie_frames_nominal(44100, 40, &rem), 221u);
+	KUNIT_EXPECT_EQ(test, rem, 0u);
+
+	KUNIT_EXPECT_EQ(test, eie_frames_nominal(96000, 8, &rem), 96u);
+	KUNIT_EXPECT_EQ(test, rem, 0u);
+}
+
+static void eie_test_iso_layout(struct kunit *test)
+{
+	const unsigned int even[4] = { 2, 3, 2, 3 };
+	const unsigned int sparse[8] = { 0, 1, 1, 1, 0, 1, 1, 1 };
+	unsigned int pkt_frames[EIE_PLAY_PKT_CNT];
+	unsigned int i, sum;
+
+	eie_iso_layout(10, 4, pkt_frames);
+	for (i = 0; i < 4; i++)
+		KUNIT_EXPECT_EQ(test, pkt_frames[i], even[i]);
+
+	eie_iso_layout(6, 8, pkt_frames);
+	for (i = 0; i < 8; i++)
+		KUNIT_EXPECT_EQ(test, pkt_frames[i], sparse[i]);
+
+	eie_iso_layout(221, EIE_PLAY_PKT_CNT, pkt_frames);
+	for (i = 0, sum = 0; i < EIE_PLAY_PKT_CNT; i++) {
+		KUNIT_EXPECT_GE(test, pkt_frames[i], 5u);
+		KUNIT_EXPECT_LE(test, pkt_frames[i], 6u);
+		sum += pkt_frames[i];
+	}
+	KUNIT_EXPECT_EQ(test, sum, 221u);
+}
+
+static void eie_test_layout_table(struct kunit *test)
+{
+	struct eie_layout_table *t;
+	const struct eie_pkt_desc *desc;
+	unsigned int pkt_frames[EIE_PLAY_PKT_CNT];
+	unsigned int frames, i, offset;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+
+	/* 48 frames per 1 ms URB, 6 in each packet */
+	eie_layout_table_init(t, 48000, 8);
+	KUNIT_EXPECT_EQ(test, t->pkts, 8u);
+	KUNIT_EXPECT_EQ(test, t->base, 39u);
+	desc = eie_layout_lookup(t, 48, 8);
+	KUNIT_ASSERT_NOT_NULL(test, desc);
+	for (i = 0; i < 8; i++) {
+		KUNIT_EXPECT_EQ(test, desc[i].offset, 72 * i);
+		KUNIT_EXPECT_EQ(test, desc[i].length, 72u);
+	}
+
+	/* only the counts eie_frames_adjust() can return */
+	KUNIT_EXPECT_NULL(test, eie_layout_lookup(t, 38, 8));
+	KUNIT_EXPECT_NOT_NULL(test, eie_layout_lookup(t, 58, 8));
+	KUNIT_EXPECT_NULL(test, eie_layout_lookup(t, 59, 8));
+	KUNIT_EXPECT_NULL(test, eie_layout_lookup(t, 48, 40));
+
+	/* every layout matches eie_iso_layout() */
+	eie_layout_table_init(t, 44100, EIE_PLAY_PKT_CNT);
+	KUNIT_EXPECT_EQ(test, t->base, 211u);
+	for (frames = t->base; frames < t->base + EIE_LAYOUT_SPAN; frames++) {
+		desc = eie_layout_lookup(t, frames, EIE_PLAY_PKT_CNT);
+		KUNIT_ASSERT_NOT_NULL(test, desc);
+		eie_iso_layout(frames, EIE_PLAY_PKT_CNT, pkt_frames);
+		for (i = 0, offset = 0; i < EIE_PLAY_PKT_CNT; i++) {
+			KUNIT_EXPECT_EQ(test, desc[i].offset, offset);
+			KUNIT_EXPECT_EQ(test, desc[i].length,
+				pkt_frames[i] * EIE_PLAY_FRAME_BYTES);
+			offset += desc[i].length;
+		}
+	}
+
+	/* no table without a rate */
+	eie_layout_table_init(t, 0, 8);
+	KUNIT_EXPECT_EQ(test, t->pkts, 0u);
+	KUNIT_EXPECT_NULL(test, eie_layout_lookup(t, 48, 8));
+}
+
+static struct kunit_case eie_stream_test_cases[] = {
+	KUNIT_CASE(eie_test_decode_frame),
+	KUNIT_CASE(eie_test_pack_frame),
+	KUNIT_CASE(eie_test_pack_frames32),
+	KUNIT_CASE(eie_test_frames_nominal),
+	KUNIT_CASE(eie_test_iso_layout),
+	KUNIT_CASE(eie_test_layout_table),
+	{}
+};
+
+static struct kunit_suite eie_stream_test_suite = {
+	.name = "eie-stream",
+	.test_cases = eie_stream_test_cases,
+};
+kunit_test_suite(eie_stream_test_suite);
+
+MODULE_DESCRIPTION("Akai EIE pro stream core tests");
+MODULE_LICENSE("GPL v2");
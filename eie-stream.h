@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Stream pacing, playback packing and capture decoding of the EIE pro.
+ * Shared by the driver and the userspace tools in exp/, so keep it free of
+ * kernel-only calls. Samples are always 24-bit values in the low bits of a
+ * 32-bit word; sign extend or shift them where the format needs it.
+ */
+#ifndef EIE_STREAM_H
+#define EIE_STREAM_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <asm/byteorder.h>
+#else
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int32_t s32;
+
+#define le32_to_cpu le32toh
+#define cpu_to_le32 htole32
+typedef uint32_t __le32;
+#endif
+
+/* packets (USB microframes) per playback URB, i.e. 5 ms */
+#define EIE_PLAY_PKT_CNT 40
+/* microframes per second */
+#define EIE_PKT_RATE 8000
+/* 4 channels of 24-bit samples */
+#define EIE_PLAY_FRAME_BYTES 12
+/* 4 channels, 2 bits in each of the 64 bytes */
+#define EIE_CAP_FRAME_BYTES 64
+
+/*
+ * Frames in the next playback URB of pkts packets when the clock tells
+ * nothing better. The fraction of a frame is carried over in *rem, so at
+ * 44.1 kHz 5 ms URBs alternate between 220 and 221 frames.
+ */
+static inline unsigned int eie_frames_nominal(unsigned int rate,
+	unsigned int pkts, unsigned int *rem)
+{
+	unsigned int n = rate * pkts + *rem;
+
+	*rem = n % EIE_PKT_RATE;
+	return n / EIE_PKT_RATE;
+}
+
+/* the clock counts followed are less than this far from the nominal one */
+#define EIE_ADJUST_WINDOW 10
+
+/* Follows the device clock, ignoring values far from the nominal count. */
+static inline unsigned int eie_frames_adjust(unsigned int wanted,
+	unsigned int elapsed)
+{
+	if (elapsed > wanted - EIE_ADJUST_WINDOW
+		&& elapsed < wanted + EIE_ADJUST_WINDOW)
+		return elapsed;
+	return wanted;
+}
+
+/* Spreads the frames evenly over the pkts packets of a playback URB. */
+static inline void eie_iso_layout(unsigned int frames, unsigned int pkts,
+	unsigned int *pkt_frames)
+{
+	unsigned int filled = 0;
+	unsigned int i;
+
+	for (i = 0; i < pkts; i++) {
+		pkt_frames[i] = frames * (i + 1) / pkts - filled;
+		filled += pkt_frames[i];
+	}
+}
+
+/* frame counts of a playback URB that eie_frames_adjust() can return */
+#define EIE_LAYOUT_SPAN (2 * EIE_ADJUST_WINDOW)
+
+struct eie_pkt_desc {
+	u16 offset; /* in bytes */
+	u16 length;
+};
+
+/*
+ * The iso packet descriptors of every frame count a playback URB of pkts
+ * packets can get at one rate, so filling an URB needs no divisions.
+ */
+struct eie_layout_table {
+	unsigned int pkts; /* 0 when not built */
+	unsigned int base; /* frames of the first layout */
+	struct eie_pkt_desc desc[EIE_LAYOUT_SPAN][EIE_PLAY_PKT_CNT];
+};
+
+static inline void eie_layout_table_init(struct eie_layout_table *t,
+	unsigned int rate, unsigned int pkts)
+{
+	unsigned int pkt_frames[EIE_PLAY_PKT_CNT];
+	unsigned int offset;
+	unsigned int f, i;
+
+	t->pkts = 0;
+	t->base = rate * pkts / EIE_PKT_RATE;
+	if (rate == 0 || pkts > EIE_PLAY_PKT_CNT || t->base < EIE_ADJUST_WINDOW)
+		return;
+	t->base -= EIE_ADJUST_WINDOW - 1;
+
+	for (f = 0; f < EIE_LAYOUT_SPAN; f++) {
+		eie_iso_layout(t->base + f, pkts, pkt_frames);
+		for (i = 0, offset = 0; i < pkts; i++) {
+			t->desc[f][i].offset = offset;
+			t->desc[f][i].length = pkt_frames[i] * EIE_PLAY_FRAME_BYTES;
+			offset += t->desc[f][i].length;
+		}
+	}
+	t->pkts = pkts;
+}
+
+/* Returns the descriptors for the frames, NULL when not in the table. */
+static inline const struct eie_pkt_desc *eie_layout_lookup(
+	const struct eie_layout_table *t, unsigned int frames, unsigned int pkts)
+{
+	if (pkts != t->pkts || frames - t->base >= EIE_LAYOUT_SPAN)
+		return NULL;
+	return t->desc[frames - t->base];
+}
+
+/*
+ * Decodes one captured frame into 24-bit samples in the low bits of ch.
+ * Channels 1 and 3 are the bits 0 and 1 of in[0..23], channels 2 and 4 of
+ * in[32..55], most significant bit first.
+ */
+static inline void eie_decode_frame(const u8 *in, u32 ch[4])
+{
+	unsigned int j;
+
+	ch[0] = ch[1] = ch[2] = ch[3] = 0;
+	for (j = 0; j < 24; j++) {
+		ch[0] |= (in[j +  0]        & 1) << (23-j);
+		ch[1] |= (in[j + 32]        & 1) << (23-j);
+		ch[2] |= ((in[j +  0] >> 1) & 1) << (23-j);
+		ch[3] |= ((in[j + 32] >> 1) & 1) << (23-j);
+	}
+}
+
+/* Packs 4 samples into the 12 B frame of the playback stream. */
+static inline void eie_pack_frame(const u32 ch[4], u8 *out)
+{
+	unsigned int c;
+
+	for (c = 0; c < 4; c++, out += 3) {
+		out[0] = ch[c];
+		out[1] = ch[c] >> 8;
+		out[2] = ch[c] >> 16;
+	}
+}
+
+/* unaligned, compilers make single loads and stores of these */
+static inline u32 eie_load_le32(const u8 *p)
+{
+	__le32 w;
+
+	memcpy(&w, p, 4);
+	return le32_to_cpu(w);
+}
+
+static inline void eie_store_le32(u8 *p, u32 v)
+{
+	__le32 w = cpu_to_le32(v);
+
+	memcpy(p, &w, 4);
+}
+
+/*
+ * Packs frames of 4 samples in 32-bit little endian words into the 12 B
+ * frames of the playback stream, shifting each sample right by shift: 8
+ * sends the top 24 bits of S32_LE, 0 the low 24 bits of S24_LE. Each frame
+ * is written as three words rather than twelve bytes.
+ */
+static inline void eie_pack_frames32(const u8 *in, u8 *out,
+	unsigned int frames, unsigned int shift)
+{
+	u32 a, b, c, d;
+
+	for (; frames > 0; frames--, in += 16, out += EIE_PLAY_FRAME_BYTES) {
+		a = eie_load_le32(in) >> shift;
+		b = eie_load_le32(in + 4) >> shift;
+		c = eie_load_le32(in + 8) >> shift;
+		d = eie_load_le32(in + 12) >> shift;
+		eie_store_le32(out, (a & 0xffffff) | b << 24);
+		eie_store_le32(out + 4, (b >> 8 & 0xffff) | c << 16);
+		eie_store_le32(out + 8, (c >> 16 & 0xff) | d << 8);
+	}
+}
+
+/* Sign extends a 24-bit sample. */
+static inline s32 eie_sample_s32(u32 sample)
+{
+	return (s32) (sample << 8) >> 8;
+}
+
+#endif
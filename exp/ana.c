@@ -0,0 +1,366 @@
+/*
+ * Analyses a USB capture of the EIE pro in one pass: the frames the clock
+ * endpoint reports per microframe, the frames in the iso packets of the
+ * playback stream, the jitter of both and the drift between what was sent
+ * and what the device consumed. Reads usbmon and USBPcap captures in pcap
+ * or pcapng straight from the file, only the histograms stay in memory.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "usbmon.h"
+
+#define SYNC_EP 0x81
+#define AOUT_EP 0x02
+#define FRAME_BYTES 12
+
+/* the last bin of each histogram counts everything above */
+#define CLOCK_BINS 32
+#define PKT_BINS 32
+#define URB_BINS 1024
+/* power of 2 buckets of us */
+#define JITTER_BINS 24
+
+struct stat {
+	uint64_t n;
+	double mean, m2;
+	double min, max;
+};
+
+static void stat_add(struct stat *s, double v)
+{
+	double d = v - s->mean;
+
+	if (s->n == 0 || v < s->min)
+		s->min = v;
+	if (s->n == 0 || v > s->max)
+		s->max = v;
+	s->n++;
+	s->mean += d / s->n;
+	s->m2 += d * (v - s->mean);
+}
+
+static double stat_sd(const struct stat *s)
+{
+	return s->n > 1 ? sqrt(s->m2 / (s->n - 1)) : 0;
+}
+
+static void hist_add(uint64_t *hist, unsigned int bins, unsigned int v)
+{
+	hist[v < bins ? v : bins - 1]++;
+}
+
+/* the interval between two completions of an endpoint */
+struct interval {
+	uint64_t last_us;
+	struct stat us;
+	uint64_t hist[JITTER_BINS];
+};
+
+static void interval_add(struct interval *iv, uint64_t ts_us)
+{
+	uint64_t d;
+	unsigned int b = 0;
+
+	if (iv->last_us && ts_us >= iv->last_us) {
+		d = ts_us - iv->last_us;
+		stat_add(&iv->us, d);
+		while (d >> b && b < JITTER_BINS - 1)
+			b++;
+		iv->hist[b]++;
+	}
+	iv->last_us = ts_us;
+}
+
+static struct {
+	unsigned int rate;
+	unsigned int devnum;
+	int verbose;
+
+	/* clock endpoint */
+	uint64_t microframes;
+	uint64_t clock_frames;
+	uint64_t clock_first_us, clock_last_us;
+	struct stat clock;
+	uint64_t clock_hist[CLOCK_BINS];
+	struct interval clock_iv;
+
+	/* playback */
+	uint64_t out_urbs;
+	uint64_t out_frames;
+	uint64_t out_pkts;
+	uint64_t out_odd; /* packets not a multiple of the frame size */
+	struct stat urb_frames;
+	uint64_t pkt_hist[PKT_BINS];
+	uint64_t urb_hist[URB_BINS];
+	struct interval out_iv;
+
+	/* sent minus consumed since the first playback submission */
+	int started;
+	int64_t drift;
+	int64_t drift_min, drift_max;
+} st = {
+	.rate = 44100,
+};
+
+static void clock_microframe(const struct usbmon_event *ev, const uint8_t *p,
+	uint32_t len)
+{
+	uint32_t i;
+
+	if (st.verbose) {
+		printf("In:");
+		for (i = 0; i < len; i++)
+			printf(" %02x", p[i]);
+		printf("\n");
+	}
+
+	if (st.microframes++ == 0)
+		st.clock_first_us = ev->ts_us;
+	st.clock_last_us = ev->ts_us;
+	st.clock_frames += p[0];
+	stat_add(&st.clock, p[0]);
+	hist_add(st.clock_hist, CLOCK_BINS, p[0]);
+
+	if (st.started) {
+		st.drift -= p[0];
+		if (st.drift < st.drift_min)
+			st.drift_min = st.drift;
+	}
+}
+
+static void clock_complete(const struct usbmon_event *ev)
+{
+	const struct usbmon_iso_desc *d;
+	uint32_t i;
+
+	if (ev->status != 0)
+		return;
+	interval_add(&st.clock_iv, ev->ts_us);
+
+	/* the 48 B usbmon headers carry no descriptors */
+	if (ev->ndesc == 0 && ev->data_len > 0)
+		clock_microframe(ev, ev->data, ev->data_len);
+
+	for (i = 0; i < ev->ndesc; i++) {
+		d = &ev->desc[i];
+		if (d->status != 0 || d->len == 0 || d->offset >= ev->data_len)
+			continue;
+		clock_microframe(ev, ev->data + d->offset,
+			d->len < ev->data_len - d->offset ?
+			d->len : ev->data_len - d->offset);
+	}
+}
+
+static void out_submit(const struct usbmon_event *ev)
+{
+	unsigned int lens[USBMON_MAX_ISO_DESC];
+	unsigned int seen = 0;
+	unsigned int frames = 0;
+	unsigned int i, j, n;
+
+	for (i = 0; i < ev->ndesc; i++) {
+		frames += ev->desc[i].len / FRAME_BYTES;
+		if (ev->desc[i].len % FRAME_BYTES)
+			st.out_odd++;
+		hist_add(st.pkt_hist, PKT_BINS, ev->desc[i].len / FRAME_BYTES);
+	}
+	st.out_pkts += ev->ndesc;
+	if (ev->ndesc == 0)
+		frames = ev->urb_len / FRAME_BYTES;
+
+	if (st.verbose) {
+		/* the packet sizes with their counts, then the frames of each */
+		printf("Out: {");
+		for (i = 0; i < ev->ndesc; i++) {
+			for (j = 0; j < seen && lens[j] != ev->desc[i].len; j++)
+				;
+			if (j < seen)
+				continue;
+			lens[seen++] = ev->desc[i].len;
+			for (n = 0, j = i; j < ev->ndesc; j++)
+				n += ev->desc[j].len == ev->desc[i].len;
+			printf("%s%u: %u", i ? ", " : "", ev->desc[i].len, n);
+		}
+		printf("}");
+		for (i = 0; i < ev->ndesc; i++)
+			printf(" %u", ev->desc[i].len / FRAME_BYTES);
+		printf("\n");
+	}
+
+	st.started = 1;
+	st.drift += frames;
+	if (st.drift > st.drift_max)
+		st.drift_max = st.drift;
+
+	st.out_urbs++;
+	st.out_frames += frames;
+	stat_add(&st.urb_frames, frames);
+	hist_add(st.urb_hist, URB_BINS, frames);
+}
+
+static double ppm(double measured, double nominal)
+{
+	return (measured / nominal - 1) * 1e6;
+}
+
+static void print_hist(const char *name, const uint64_t *hist,
+	unsigned int bins, uint64_t total)
+{
+	unsigned int i;
+
+	printf("%s:\n", name);
+	for (i = 0; i < bins; i++)
+		if (hist[i])
+			printf("  %s%5u %12llu %7.3f%%\n",
+				i == bins - 1 ? ">=" : "  ", i,
+				(unsigned long long) hist[i],
+				100.0 * hist[i] / total);
+}
+
+static void print_interval(const char *name, const struct interval *iv)
+{
+	unsigned int i;
+
+	if (iv->us.n == 0)
+		return;
+	printf("%s: %.1f us avg, %.1f us sd, %.0f..%.0f us\n", name,
+		iv->us.mean, stat_sd(&iv->us), iv->us.min, iv->us.max);
+	for (i = 0; i < JITTER_BINS; i++)
+		if (iv->hist[i])
+			printf("  <%8llu us %12llu %7.3f%%\n",
+				1ULL << i, (unsigned long long) iv->hist[i],
+				100.0 * iv->hist[i] / iv->us.n);
+}
+
+static void report(const struct usbmon_reader *r, double wall)
+{
+	double usb_s = st.microframes * 125e-6;
+	double host_s = (st.clock_last_us - st.clock_first_us) / 1e6;
+
+	printf("trace: %llu records, analysed in %.3f s (%.0f records/s)\n",
+		(unsigned long long) r->records, wall,
+		wall > 0 ? r->records / wall : 0);
+
+	if (st.microframes) {
+		printf("clock: %llu microframes, %llu frames, %.4f avg, %.4f sd\n",
+			(unsigned long long) st.microframes,
+			(unsigned long long) st.clock_frames,
+			st.clock.mean, stat_sd(&st.clock));
+		printf("clock: %.2f Hz by USB frames (%+.1f ppm)\n",
+			st.clock_frames / usb_s,
+			ppm(st.clock_frames / usb_s, st.rate));
+		if (host_s > 0)
+			printf("clock: %.2f Hz by host time (%+.1f ppm)\n",
+				st.clock_frames / host_s,
+				ppm(st.clock_frames / host_s, st.rate));
+		print_hist("clock frames per microframe", st.clock_hist,
+			CLOCK_BINS, st.microframes);
+		print_interval("clock completions", &st.clock_iv);
+	}
+
+	if (st.out_urbs) {
+		printf("playback: %llu URBs, %llu frames, %.0f..%.0f per URB (avg %.2f, sd %.2f)",
+			(unsigned long long) st.out_urbs,
+			(unsigned long long) st.out_frames,
+			st.urb_frames.min, st.urb_frames.max,
+			st.urb_frames.mean, stat_sd(&st.urb_frames));
+		if (st.out_odd)
+			printf(", %llu packets of partial frames",
+				(unsigned long long) st.out_odd);
+		printf("\n");
+		if (st.out_pkts)
+			print_hist("playback frames per packet", st.pkt_hist,
+				PKT_BINS, st.out_pkts);
+		print_hist("playback frames per URB", st.urb_hist, URB_BINS,
+			st.out_urbs);
+		print_interval("playback completions", &st.out_iv);
+		printf("drift: %+lld frames sent ahead of the clock (%lld..%lld)\n",
+			(long long) st.drift, (long long) st.drift_min,
+			(long long) st.drift_max);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [-r rate] [-d devnum] trace\n"
+		"  -v prints the clock and the playback packets of each URB\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct usbmon_reader r;
+	struct usbmon_event *ev;
+	struct timespec t0, t1;
+	FILE *f;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "vr:d:h")) != -1) {
+		switch (opt) {
+		case 'v':
+			st.verbose = 1;
+			break;
+		case 'r':
+			st.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			st.devnum = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (usbmon_open(&r, f) < 0) {
+		fprintf(stderr, "%s: not a USB pcap or pcapng file\n",
+			argv[optind]);
+		return 1;
+	}
+
+	ev = malloc(sizeof(*ev));
+	if (!ev)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while ((ret = usbmon_next(&r, ev)) > 0) {
+		if (st.devnum && ev->devnum != st.devnum)
+			continue;
+		if (ev->xfer_type != USBMON_ISO)
+			continue;
+
+		if (ev->type == 'C' && ev->ep == SYNC_EP)
+			clock_complete(ev);
+		else if (ev->type == 'S' && ev->ep == AOUT_EP)
+			out_submit(ev);
+		else if (ev->type == 'C' && ev->ep == AOUT_EP)
+			interval_add(&st.out_iv, ev->ts_us);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (ret < 0)
+		fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+
+	report(&r, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+	free(ev);
+	usbmon_close(&r);
+	fclose(f);
+	return 0;
+}
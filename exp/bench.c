@@ -0,0 +1,271 @@
+/*
+ * Measures the per-frame cost of the stream code in eie-stream.h at each
+ * rate: the pacing and iso layout of a playback URB, computed as the driver
+ * used to and looked up in the layout table, the packing of the playback
+ * frames byte by byte and from S32_LE a word at a time, and the decoding of
+ * the captured ones, in the driver and by the raw capture library in
+ * eie-raw.c. Run it before and after a change of the hot path.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../eie-stream.h"
+#include "eie-raw.h"
+
+/* 5 ms URBs, about 10 s of audio per rate and stage */
+#define URBS 2000
+#define MAX_URB_FRAMES 490
+
+static const unsigned int rates[] = { 44100, 48000, 88200, 96000 };
+
+/* stands in for the iso descriptors of the URB */
+static struct {
+	unsigned int offset;
+	unsigned int length;
+} iso_desc[EIE_PLAY_PKT_CNT];
+
+static struct eie_layout_table table;
+
+/* the driver shortens URBs for short periods, keep the count unknown */
+static volatile unsigned int play_pkts = EIE_PLAY_PKT_CNT;
+
+static u8 cap_buf[MAX_URB_FRAMES * EIE_CAP_FRAME_BYTES];
+static u8 play_buf[MAX_URB_FRAMES * EIE_PLAY_FRAME_BYTES];
+static u32 samples[MAX_URB_FRAMES][4];
+static u32 decoded[MAX_URB_FRAMES][4];
+static u8 s32_buf[MAX_URB_FRAMES * 16];
+static u8 packed[MAX_URB_FRAMES * EIE_PLAY_FRAME_BYTES];
+
+/* keeps the compiler from dropping the work */
+static volatile u32 sink;
+
+static double now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* the clock wanders by a frame around the nominal count */
+static unsigned int clock_frames(unsigned int n, int u)
+{
+	return eie_frames_adjust(n, n + (u & 3) - 1);
+}
+
+static double bench_layout(unsigned int rate, uint64_t *frames)
+{
+	unsigned int pkt_frames[EIE_PLAY_PKT_CNT];
+	unsigned int pkts = play_pkts;
+	unsigned int rem = 0;
+	unsigned int n, i, filled;
+	double t;
+	int u;
+
+	*frames = 0;
+	t = now_ns();
+	for (u = 0; u < URBS; u++) {
+		n = clock_frames(eie_frames_nominal(rate, pkts, &rem), u);
+		eie_iso_layout(n, pkts, pkt_frames);
+		for (i = 0, filled = 0; i < pkts; i++) {
+			iso_desc[i].offset = filled * EIE_PLAY_FRAME_BYTES;
+			iso_desc[i].length = pkt_frames[i] * EIE_PLAY_FRAME_BYTES;
+			filled += pkt_frames[i];
+		}
+		sink += iso_desc[EIE_PLAY_PKT_CNT - 1].length;
+		*frames += n;
+	}
+	return now_ns() - t;
+}
+
+/* as fill_playback_urb() does it, rewriting only changed layouts */
+static double bench_table(unsigned int rate, uint64_t *frames)
+{
+	const struct eie_pkt_desc *d;
+	unsigned int pkts = play_pkts;
+	unsigned int rem = 0;
+	unsigned int last = 0;
+	unsigned int n, i;
+	double t;
+	int u;
+
+	eie_layout_table_init(&table, rate, pkts);
+
+	*frames = 0;
+	t = now_ns();
+	for (u = 0; u < URBS; u++) {
+		n = clock_frames(eie_frames_nominal(rate, pkts, &rem), u);
+		if (n != last) {
+			d = eie_layout_lookup(&table, n, pkts);
+			for (i = 0; i < pkts; i++) {
+				iso_desc[i].offset = d[i].offset;
+				iso_desc[i].length = d[i].length;
+			}
+			last = n;
+		}
+		sink += iso_desc[EIE_PLAY_PKT_CNT - 1].length;
+		*frames += n;
+	}
+	return now_ns() - t;
+}
+
+static double bench_pack(unsigned int rate, uint64_t *frames)
+{
+	unsigned int rem = 0;
+	unsigned int n, i;
+	double t;
+	int u;
+
+	*frames = 0;
+	t = now_ns();
+	for (u = 0; u < URBS; u++) {
+		n = eie_frames_nominal(rate, EIE_PLAY_PKT_CNT, &rem);
+		for (i = 0; i < n; i++)
+			eie_pack_frame(samples[i], play_buf + EIE_PLAY_FRAME_BYTES * i);
+		sink += play_buf[u % sizeof(play_buf)];
+		*frames += n;
+	}
+	return now_ns() - t;
+}
+
+static double bench_pack32(unsigned int rate, uint64_t *frames)
+{
+	unsigned int rem = 0;
+	unsigned int n;
+	double t;
+	int u;
+
+	*frames = 0;
+	t = now_ns();
+	for (u = 0; u < URBS; u++) {
+		n = eie_frames_nominal(rate, EIE_PLAY_PKT_CNT, &rem);
+		eie_pack_frames32(s32_buf, play_buf, n, 8);
+		sink += play_buf[u % sizeof(play_buf)];
+		*frames += n;
+	}
+	return now_ns() - t;
+}
+
+/* both ways of packing have to give the same stream */
+static int check_pack32(void)
+{
+	unsigned int i, c;
+
+	for (i = 0; i < MAX_URB_FRAMES; i++) {
+		for (c = 0; c < 4; c++)
+			eie_store_le32(s32_buf + 16 * i + 4 * c, samples[i][c] << 8);
+		eie_pack_frame(samples[i], play_buf + EIE_PLAY_FRAME_BYTES * i);
+	}
+	eie_pack_frames32(s32_buf, packed, MAX_URB_FRAMES, 8);
+	if (memcmp(packed, play_buf, sizeof(packed))) {
+		fprintf(stderr, "S32_LE packing differs\n");
+		return -1;
+	}
+	return 0;
+}
+
+static double bench_decode(unsigned int rate, uint64_t *frames)
+{
+	unsigned int rem = 0;
+	unsigned int n, i;
+	u32 ch[4];
+	double t;
+	int u;
+
+	*frames = 0;
+	t = now_ns();
+	for (u = 0; u < URBS; u++) {
+		n = eie_frames_nominal(rate, EIE_PLAY_PKT_CNT, &rem);
+		for (i = 0; i < n; i++) {
+			eie_decode_frame(cap_buf + EIE_CAP_FRAME_BYTES * i, ch);
+			sink += ch[0] ^ ch[1] ^ ch[2] ^ ch[3];
+		}
+		*frames += n;
+	}
+	return now_ns() - t;
+}
+
+static double bench_raw(unsigned int rate, uint64_t *frames)
+{
+	unsigned int rem = 0;
+	unsigned int n;
+	double t;
+	int u;
+
+	*frames = 0;
+	t = now_ns();
+	for (u = 0; u < URBS; u++) {
+		n = eie_frames_nominal(rate, EIE_PLAY_PKT_CNT, &rem);
+		eie_raw_decode(cap_buf, decoded[0], n);
+		sink += decoded[u % n][u & 3];
+		*frames += n;
+	}
+	return now_ns() - t;
+}
+
+/* the library has to match the driver bit for bit */
+static int check_raw(void)
+{
+	u32 ch[4];
+	unsigned int i;
+
+	eie_raw_decode(cap_buf, decoded[0], MAX_URB_FRAMES);
+	for (i = 0; i < MAX_URB_FRAMES; i++) {
+		eie_decode_frame(cap_buf + EIE_CAP_FRAME_BYTES * i, ch);
+		if (memcmp(ch, decoded[i], sizeof(ch))) {
+			fprintf(stderr, "%s decode differs at frame %u\n",
+				eie_raw_impl(), i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	uint64_t frames;
+	unsigned int r, i;
+	double ns;
+
+	srand(1);
+	/* the upper bits are noise the decoder has to ignore */
+	for (i = 0; i < sizeof(cap_buf); i++)
+		cap_buf[i] = rand();
+	for (i = 0; i < MAX_URB_FRAMES; i++)
+		samples[i][0] = samples[i][1] = samples[i][2] = samples[i][3] =
+			rand() & 0xffffff;
+
+	/* warm up the caches and the CPU clock */
+	bench_layout(rates[0], &frames);
+	bench_table(rates[0], &frames);
+	bench_pack(rates[0], &frames);
+	bench_decode(rates[0], &frames);
+	if (check_raw() < 0 || check_pack32() < 0)
+		return 1;
+	bench_pack32(rates[0], &frames);
+
+	printf("%8s %12s %12s %12s %12s %12s %12s\n", "rate", "layout",
+		"table", "pack", "pack32", "decode", eie_raw_impl());
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		printf("%8u", rates[r]);
+		ns = bench_layout(rates[r], &frames);
+		printf(" %9.2f ns", ns / frames);
+		ns = bench_table(rates[r], &frames);
+		printf(" %9.2f ns", ns / frames);
+		ns = bench_pack(rates[r], &frames);
+		printf(" %9.2f ns", ns / frames);
+		ns = bench_pack32(rates[r], &frames);
+		printf(" %9.2f ns", ns / frames);
+		ns = bench_decode(rates[r], &frames);
+		printf(" %9.2f ns", ns / frames);
+		ns = bench_raw(rates[r], &frames);
+		printf(" %9.2f ns", ns / frames);
+		printf("\n");
+	}
+	printf("(per frame)\n");
+
+	return 0;
+}
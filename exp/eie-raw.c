@@ -0,0 +1,85 @@
+#include "eie-raw.h"
+#include "../eie-stream.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+static void decode_scalar(const uint8_t *in, uint32_t *out, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i < frames; i++)
+		eie_decode_frame(in + EIE_CAP_FRAME_BYTES * i, out + 4 * i);
+}
+
+#ifdef HAVE_AVX2
+/*
+ * The bits 0 and 1 of 24 bytes make two samples, the first byte is the most
+ * significant bit. The bytes are reversed so that movemask, which takes the
+ * top bit of each byte from the first one up, puts them in place; the
+ * shifts move bit 0 and bit 1 to the top.
+ */
+__attribute__((target("avx2")))
+static inline void decode_half(const uint8_t *in, uint32_t *lo, uint32_t *hi)
+{
+	const __m256i rev = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	__m256i v = _mm256_loadu_si256((const __m256i *) in);
+
+	/* bytes 16..23 to the bottom, then 8..15 and 0..7 */
+	v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 0, 1, 2));
+	v = _mm256_shuffle_epi8(v, rev);
+	*lo = _mm256_movemask_epi8(_mm256_slli_epi16(v, 7)) & 0xffffff;
+	*hi = _mm256_movemask_epi8(_mm256_slli_epi16(v, 6)) & 0xffffff;
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(const uint8_t *in, uint32_t *out, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i < frames; i++, in += EIE_CAP_FRAME_BYTES, out += 4) {
+		decode_half(in, &out[0], &out[2]);
+		decode_half(in + 32, &out[1], &out[3]);
+	}
+}
+#endif
+
+static void decode_first(const uint8_t *in, uint32_t *out, size_t frames);
+
+static void (*decode)(const uint8_t *, uint32_t *, size_t) = decode_first;
+static const char *impl = "scalar";
+
+static void pick(void)
+{
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		decode = decode_avx2;
+		impl = "avx2";
+		return;
+	}
+#endif
+	decode = decode_scalar;
+}
+
+static void decode_first(const uint8_t *in, uint32_t *out, size_t frames)
+{
+	pick();
+	decode(in, out, frames);
+}
+
+void eie_raw_decode(const uint8_t *in, uint32_t *out, size_t frames)
+{
+	decode(in, out, frames);
+}
+
+const char *eie_raw_impl(void)
+{
+	if (decode == decode_first)
+		pick();
+	return impl;
+}
@@ -0,0 +1,19 @@
+/*
+ * Decodes the frames of the raw capture substream ("Capture Raw", 64 U8
+ * channels) into the 4 channels of 24-bit samples the decoded capture
+ * substream delivers. The fastest code the CPU runs is picked at the first
+ * call.
+ */
+#ifndef EIE_RAW_H
+#define EIE_RAW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64 B frames in, 4 samples per frame out, in the low 24 bits */
+void eie_raw_decode(const uint8_t *in, uint32_t *out, size_t frames);
+
+/* the name of the implementation eie_raw_decode() uses */
+const char *eie_raw_impl(void);
+
+#endif
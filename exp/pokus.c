@@ -8,6 +8,8 @@
 
 #include <sndfile.h>
 
+#include "../eie-stream.h"
+
 static void dump(char *prefix, unsigned char *data, int len) {
 	// return;
 	struct timespec spec;
@@ -48,13 +50,11 @@ static void init_audio_data() {
 	int c = 0;
 	for (i = 0; i < (44100+2000); i++) {
 		int ch1 = (int)((sin(440.*i/44100*2*M_PI)+1)*0x7fffff) - 0x7fffff;
-		audio_data[i*12   + 3*c] = ch1 & 0xff;
-		audio_data[i*12+1 + 3*c] = (ch1 >> 8) & 0xff;
-		audio_data[i*12+2 + 3*c] = (ch1 >> 16) & 0xff;
+		u32 ch[4] = {0, 0, 0, 0};
 
-		audio_data[i*12   + 3*(c+1)] = ch1 & 0xff;
-		audio_data[i*12+1 + 3*(c+1)] = (ch1 >> 8) & 0xff;
-		audio_data[i*12+2 + 3*(c+1)] = (ch1 >> 16) & 0xff;
+		ch[c] = ch1;
+		ch[c+1] = ch1;
+		eie_pack_frame(ch, &audio_data[i*12]);
 	}
 	aout_pos = 0;
 }
@@ -92,20 +92,17 @@ static void sync_iso_cb(struct libusb_transfer* tr) {
 static void fill_aout_data(struct libusb_transfer* tr) {
 	tr->buffer = &audio_data[aout_pos*12];
 	// ignore stupid values of eie clock -> allow only small adjustments
-	int expected_d = requested_fill[current_fill];
-	if (eie_clock_d < expected_d - 10 || eie_clock_d > expected_d + 10) {
-		eie_clock_d = expected_d;
-	}
-	int samples = eie_clock_d;
+	int samples = eie_frames_adjust(requested_fill[current_fill], eie_clock_d);
 	eie_clock_d = 0;
 
+	unsigned int pkt_frames[EIE_PLAY_PKT_CNT];
 	int i;
 	int have = 0;
-	for (i = 0; i < 40; i++) {
-		int l =  samples * (i+1) / 40 - have;
-		have += l;
-		tr->iso_packet_desc[i].length = l * 12;
-		// printf("%d ", l);
+	eie_iso_layout(samples, EIE_PLAY_PKT_CNT, pkt_frames);
+	for (i = 0; i < EIE_PLAY_PKT_CNT; i++) {
+		have += pkt_frames[i];
+		tr->iso_packet_desc[i].length = pkt_frames[i] * EIE_PLAY_FRAME_BYTES;
+		// printf("%d ", pkt_frames[i]);
 	}
 	printf(" - %d\n", have);
 	current_fill++;
@@ -137,19 +134,12 @@ static void ain_bulk_cb(struct libusb_transfer* tr) {
 		// dump("ain: ", ain, 60);
 		// fwrite(ain, 1, tr->actual_length, f);
 		int i, j;
-		for (i = 0; i < tr->actual_length / 64; i++) {
-			out[4*i+0] = 0;
-			out[4*i+1] = 0;
-			out[4*i+2] = 0;
-			out[4*i+3] = 0;
-			for (j = 0; j < 24; j++) {
-				out[4*i+0] |= (ain[64*i + j] & 1) << (31-j);
-				out[4*i+2] |= (ain[64*i + j] & 2) << (30-j);
-			}
-			for (j = 32; j < 56; j++) {
-				out[4*i+1] |= (ain[64*i + j] & 1) << (63-j);
-				out[4*i+3] |= (ain[64*i + j] & 2) << (62-j);
-			}
+		u32 ch[4];
+		for (i = 0; i < tr->actual_length / EIE_CAP_FRAME_BYTES; i++) {
+			eie_decode_frame(&ain[EIE_CAP_FRAME_BYTES*i], ch);
+			// libsndfile wants the 24 bits at the top of the int
+			for (j = 0; j < 4; j++)
+				out[4*i+j] = ch[j] << 8;
 		}
 		sf_writef_int(file, out, tr->actual_length / 64);
 	} else {
@@ -0,0 +1,401 @@
+/*
+ * Replays a usbmon capture of the EIE pro through the pacing and capture
+ * decoding of the driver (eie-stream.h) and reports what the driver would
+ * have done: frames per playback URB, how full the device FIFO gets, the
+ * drift of the device clock and the capture throughput.
+ *
+ * When the trace contains the playback submissions of the driver, the
+ * predicted frame counts are compared with the recorded ones, so a pacing
+ * change can be checked against field captures without the hardware.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../eie-stream.h"
+#include "usbmon.h"
+
+#define SYNC_EP 0x81
+#define AOUT_EP 0x02
+#define AIN_EP 0x85
+
+/* playback URBs in flight, the predictions waiting for their submission */
+#define PREDICTED_MAX 8
+
+struct minmax {
+	int64_t min, max, sum;
+	uint64_t n;
+};
+
+static void minmax_add(struct minmax *m, int64_t v)
+{
+	if (m->n == 0 || v < m->min)
+		m->min = v;
+	if (m->n == 0 || v > m->max)
+		m->max = v;
+	m->sum += v;
+	m->n++;
+}
+
+static struct {
+	unsigned int rate;
+	unsigned int cap_ep;
+	unsigned int devnum;
+	FILE *out;
+
+	uint64_t first_us, last_us;
+
+	/* clock endpoint */
+	unsigned int frames_elapsed; /* since the last fill, as in the driver */
+	uint64_t clock_frames;
+	uint64_t microframes;
+	uint64_t zero_microframes;
+	uint64_t clock_first_us, clock_last_us;
+	unsigned int clock_missed; /* packets lost since the last one */
+	uint64_t recovered; /* lost packets read from the next one */
+
+	/* playback */
+	unsigned int wanted_rem;
+	int started;
+	uint64_t play_urbs;
+	uint64_t frames_sent;
+	uint64_t frames_consumed;
+	struct minmax fifo;
+	struct minmax urb_frames;
+	unsigned int max_pkt_frames;
+	unsigned int predicted[PREDICTED_MAX];
+	unsigned int pred_head, pred_len;
+	uint64_t initial, matched, mismatched;
+
+	/* capture */
+	uint64_t cap_transfers;
+	uint64_t cap_frames;
+	uint64_t cap_partial;
+	uint8_t cap_carry[EIE_CAP_FRAME_BYTES]; /* as in the driver */
+	unsigned int cap_carry_len;
+	uint64_t cap_clock_start;
+} st = {
+	.rate = 44100,
+	.cap_ep = AIN_EP,
+};
+
+static void clock_microframe(uint64_t ts_us, unsigned int d)
+{
+	if (st.microframes++ == 0)
+		st.clock_first_us = ts_us;
+	st.clock_last_us = ts_us;
+	if (d == 0)
+		st.zero_microframes++;
+	st.frames_elapsed += d;
+	st.clock_frames += d;
+	if (st.started)
+		st.frames_consumed += d;
+}
+
+/*
+ * What sync_urb_complete() does, the 48 B headers carry no descriptors.
+ * The 2nd and 3rd byte of a packet repeat the counts of the two before.
+ */
+static void clock_complete(const struct usbmon_event *ev)
+{
+	const uint8_t *p;
+	uint32_t len;
+	unsigned int i;
+
+	if (ev->ndesc == 0 && ev->data_len > 0)
+		clock_microframe(ev->ts_us, ev->data[0]);
+
+	for (i = 0; i < ev->ndesc; i++) {
+		if (ev->desc[i].status != 0 || ev->desc[i].len == 0
+			|| ev->desc[i].offset >= ev->data_len) {
+			st.clock_missed++;
+			continue;
+		}
+		p = ev->data + ev->desc[i].offset;
+		len = ev->data_len - ev->desc[i].offset;
+		if (len > ev->desc[i].len)
+			len = ev->desc[i].len;
+		if (st.clock_missed >= 2 && len >= 3)
+			clock_microframe(ev->ts_us, p[2]);
+		if (st.clock_missed >= 1 && len >= 2)
+			clock_microframe(ev->ts_us, p[1]);
+		st.recovered += st.clock_missed < 2 ? st.clock_missed : 2;
+		st.clock_missed = 0;
+		clock_microframe(ev->ts_us, p[0]);
+	}
+}
+
+/* what fill_playback_urb() does when a playback URB completes */
+static void play_complete(const struct usbmon_event *ev)
+{
+	unsigned int pkt_frames[USBMON_MAX_ISO_DESC];
+	unsigned int pkts = ev->ndesc ? ev->ndesc : EIE_PLAY_PKT_CNT;
+	unsigned int frames;
+	unsigned int i;
+
+	if (ev->status != 0)
+		return;
+
+	/* the driver shortens the URBs for short periods */
+	frames = eie_frames_nominal(st.rate, pkts, &st.wanted_rem);
+	frames = eie_frames_adjust(frames, st.frames_elapsed);
+	st.frames_elapsed = 0;
+
+	eie_iso_layout(frames, pkts, pkt_frames);
+	for (i = 0; i < pkts; i++)
+		if (pkt_frames[i] > st.max_pkt_frames)
+			st.max_pkt_frames = pkt_frames[i];
+
+	st.play_urbs++;
+	st.frames_sent += frames;
+	minmax_add(&st.urb_frames, frames);
+	minmax_add(&st.fifo, (int64_t) (st.frames_sent - st.frames_consumed));
+
+	if (st.pred_len == PREDICTED_MAX) {
+		st.pred_head = (st.pred_head + 1) % PREDICTED_MAX;
+		st.pred_len--;
+	}
+	st.predicted[(st.pred_head + st.pred_len++) % PREDICTED_MAX] = frames;
+}
+
+static void play_submit(const struct usbmon_event *ev)
+{
+	unsigned int frames = 0;
+	unsigned int i;
+
+	if (ev->ndesc == 0)
+		frames = ev->urb_len / EIE_PLAY_FRAME_BYTES;
+	for (i = 0; i < ev->ndesc; i++)
+		frames += ev->desc[i].len / EIE_PLAY_FRAME_BYTES;
+
+	if (st.pred_len == 0) {
+		/* submitted at the stream start, before any completion */
+		st.started = 1;
+		st.initial++;
+		st.frames_sent += frames;
+		return;
+	}
+
+	if (st.predicted[st.pred_head] == frames)
+		st.matched++;
+	else
+		st.mismatched++;
+	st.pred_head = (st.pred_head + 1) % PREDICTED_MAX;
+	st.pred_len--;
+}
+
+static void cap_frame(const uint8_t *in)
+{
+	int32_t out[4];
+	uint32_t ch[4];
+	unsigned int c;
+
+	eie_decode_frame(in, ch);
+	st.cap_frames++;
+	if (!st.out)
+		return;
+	for (c = 0; c < 4; c++)
+		out[c] = eie_sample_s32(ch[c]);
+	fwrite(out, sizeof(out), 1, st.out);
+}
+
+/* what decode_capture_urb() does, frames may span transfers */
+static void cap_complete(const struct usbmon_event *ev)
+{
+	const uint8_t *p = ev->data;
+	uint32_t len = ev->data_len;
+	unsigned int n;
+
+	if (ev->status != 0) {
+		st.cap_carry_len = 0;
+		return;
+	}
+
+	if (st.cap_transfers++ == 0)
+		st.cap_clock_start = st.clock_frames;
+
+	if (st.cap_carry_len) {
+		n = EIE_CAP_FRAME_BYTES - st.cap_carry_len;
+		if (n > len)
+			n = len;
+		memcpy(st.cap_carry + st.cap_carry_len, p, n);
+		st.cap_carry_len += n;
+		p += n;
+		len -= n;
+		if (st.cap_carry_len == EIE_CAP_FRAME_BYTES) {
+			cap_frame(st.cap_carry);
+			st.cap_carry_len = 0;
+		}
+	}
+
+	for (; len >= EIE_CAP_FRAME_BYTES; len -= EIE_CAP_FRAME_BYTES) {
+		cap_frame(p);
+		p += EIE_CAP_FRAME_BYTES;
+	}
+
+	if (len) {
+		memcpy(st.cap_carry, p, len);
+		st.cap_carry_len = len;
+		st.cap_partial++;
+	}
+}
+
+static double ppm(double measured, double nominal)
+{
+	return (measured / nominal - 1) * 1e6;
+}
+
+static void report(const struct usbmon_reader *r, double wall)
+{
+	double span = (st.last_us - st.first_us) / 1e6;
+	double usb_s = st.microframes * 125e-6;
+	double host_s = (st.clock_last_us - st.clock_first_us) / 1e6;
+
+	printf("trace: %llu records, %.3f s, replayed in %.3f s (%.0f records/s)\n",
+		(unsigned long long) r->records, span, wall,
+		wall > 0 ? r->records / wall : 0);
+
+	printf("clock: %llu microframes, %llu frames, %llu without progress\n",
+		(unsigned long long) st.microframes,
+		(unsigned long long) st.clock_frames,
+		(unsigned long long) st.zero_microframes);
+	if (st.recovered)
+		printf("clock: %llu lost microframes recovered from the next packet\n",
+			(unsigned long long) st.recovered);
+	if (usb_s > 0)
+		printf("clock: %.2f Hz by USB frames (%+.1f ppm)\n",
+			st.clock_frames / usb_s,
+			ppm(st.clock_frames / usb_s, st.rate));
+	if (host_s > 0)
+		printf("clock: %.2f Hz by host time (%+.1f ppm)\n",
+			st.clock_frames / host_s,
+			ppm(st.clock_frames / host_s, st.rate));
+
+	if (st.play_urbs) {
+		printf("playback: %llu URBs, %llu frames, %lld..%lld frames per URB (avg %.2f), max %u per packet\n",
+			(unsigned long long) st.play_urbs,
+			(unsigned long long) st.frames_sent,
+			(long long) st.urb_frames.min,
+			(long long) st.urb_frames.max,
+			(double) st.urb_frames.sum / st.urb_frames.n,
+			st.max_pkt_frames);
+		printf("playback: FIFO %lld..%lld frames (avg %.1f, last %lld)\n",
+			(long long) st.fifo.min, (long long) st.fifo.max,
+			(double) st.fifo.sum / st.fifo.n,
+			(long long) (st.frames_sent - st.frames_consumed));
+	}
+	if (st.matched + st.mismatched)
+		printf("playback: %llu initial URBs, %llu match the recording, %llu differ\n",
+			(unsigned long long) st.initial,
+			(unsigned long long) st.matched,
+			(unsigned long long) st.mismatched);
+
+	if (st.cap_transfers) {
+		uint64_t clock = st.clock_frames - st.cap_clock_start;
+
+		printf("capture: %llu transfers, %llu frames, %llu ended inside a frame\n",
+			(unsigned long long) st.cap_transfers,
+			(unsigned long long) st.cap_frames,
+			(unsigned long long) st.cap_partial);
+		if (clock)
+			printf("capture: %+.1f ppm against the clock endpoint\n",
+				ppm(st.cap_frames, clock));
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-r rate] [-c capture-ep] [-d devnum] [-o decoded.raw] trace\n"
+		"  -o writes the decoded capture as 4 channel S32 native samples\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct usbmon_reader r;
+	struct usbmon_event *ev;
+	struct timespec t0, t1;
+	FILE *f;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "r:c:d:o:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			st.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			st.cap_ep = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			st.devnum = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			st.out = fopen(optarg, "wb");
+			if (!st.out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (usbmon_open(&r, f) < 0) {
+		fprintf(stderr, "%s: not a usbmon pcap or pcapng file\n",
+			argv[optind]);
+		return 1;
+	}
+
+	ev = malloc(sizeof(*ev));
+	if (!ev)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while ((ret = usbmon_next(&r, ev)) > 0) {
+		if (st.devnum && ev->devnum != st.devnum)
+			continue;
+		if (st.first_us == 0)
+			st.first_us = ev->ts_us;
+		st.last_us = ev->ts_us;
+
+		if (ev->type == 'C' && ev->ep == SYNC_EP
+			&& ev->xfer_type == USBMON_ISO)
+			clock_complete(ev);
+		else if (ev->type == 'C' && ev->ep == AOUT_EP)
+			play_complete(ev);
+		else if (ev->type == 'S' && ev->ep == AOUT_EP)
+			play_submit(ev);
+		else if (ev->type == 'C' && ev->ep == st.cap_ep
+			&& ev->xfer_type == USBMON_BULK)
+			cap_complete(ev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (ret < 0)
+		fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+
+	report(&r, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+	free(ev);
+	usbmon_close(&r);
+	fclose(f);
+	if (st.out)
+		fclose(st.out);
+	return 0;
+}
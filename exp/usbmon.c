@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbmon.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BOM 0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL 9
+
+#define LINKTYPE_USB_LINUX 189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+#define LINKTYPE_USBPCAP 249
+
+/* the USBPcap header, 12 B of each iso packet follow the iso one */
+#define USBPCAP_HDR_LEN 27
+#define USBPCAP_ISO_HDR_LEN 39
+#define USBPCAP_INFO_PDO_TO_FDO 1
+
+static uint16_t le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t le64(const uint8_t *p)
+{
+	return le32(p) | (uint64_t) le32(p + 4) << 32;
+}
+
+static int link_of(unsigned int linktype)
+{
+	switch (linktype) {
+	case LINKTYPE_USB_LINUX:
+		return USBMON_LINK_LINUX;
+	case LINKTYPE_USB_LINUX_MMAPPED:
+		return USBMON_LINK_LINUX_MMAPPED;
+	case LINKTYPE_USBPCAP:
+		return USBMON_LINK_USBPCAP;
+	default:
+		return USBMON_LINK_NONE;
+	}
+}
+
+static int read_into(struct usbmon_reader *r, size_t len)
+{
+	if (len > r->buf_size) {
+		uint8_t *b = realloc(r->buf, len);
+
+		if (!b)
+			return -1;
+		r->buf = b;
+		r->buf_size = len;
+	}
+	return fread(r->buf, 1, len, r->f) == len ? 0 : -1;
+}
+
+int usbmon_open(struct usbmon_reader *r, FILE *f)
+{
+	uint8_t h[24];
+
+	memset(r, 0, sizeof(*r));
+	r->f = f;
+
+	if (fread(h, 1, sizeof(h), f) != sizeof(h))
+		return -1;
+
+	switch (le32(h)) {
+	case PCAP_MAGIC_US:
+	case PCAP_MAGIC_NS:
+		r->ts_div = le32(h) == PCAP_MAGIC_NS ? 1000 : 1;
+		r->link = link_of(le32(h + 20));
+		return r->link == USBMON_LINK_NONE ? -1 : 0;
+	case PCAPNG_SHB:
+		if (le32(h + 8) != PCAPNG_BOM)
+			return -1;
+		r->pcapng = 1;
+		/* skip the rest of the section header block */
+		return fseek(f, le32(h + 4) - sizeof(h), SEEK_CUR);
+	default:
+		return -1;
+	}
+}
+
+/* Timestamp units per us from the if_tsresol option, us by default. */
+static uint32_t idb_ts_div(const uint8_t *opt, long len)
+{
+	uint32_t div = 1;
+	unsigned int code, olen, exp;
+
+	while (len >= 4) {
+		code = le16(opt);
+		olen = le16(opt + 2);
+		if (code == 0 || olen + 4 > len)
+			break;
+		/* only the decimal resolutions, finer than us */
+		if (code == PCAPNG_OPT_TSRESOL && olen >= 1 && !(opt[4] & 0x80))
+			for (exp = opt[4]; exp > 6; exp--)
+				div *= 10;
+		olen = 4 + ((olen + 3) & ~3);
+		opt += olen;
+		len -= olen;
+	}
+	return div;
+}
+
+/* Reads the next packet of a USB link into r->buf, returns its length. */
+static long next_packet(struct usbmon_reader *r)
+{
+	uint8_t h[16];
+	uint32_t type, len, caplen, id;
+
+	if (!r->pcapng) {
+		if (fread(h, 1, 16, r->f) != 16)
+			return 0;
+		r->ts_us = (uint64_t) le32(h) * 1000000 + le32(h + 4) / r->ts_div;
+		caplen = le32(h + 8);
+		return read_into(r, caplen) < 0 ? -1 : (long) caplen;
+	}
+
+	for (;;) {
+		if (fread(h, 1, 8, r->f) != 8)
+			return 0;
+		type = le32(h);
+		len = le32(h + 4);
+		if (len < 12 || read_into(r, len - 8) < 0)
+			return -1;
+
+		switch (type) {
+		case PCAPNG_SHB:
+			r->ifaces = 0;
+			break;
+		case PCAPNG_IDB:
+			if (r->ifaces >= USBMON_MAX_IFACES || len < 20)
+				break;
+			r->iface_link[r->ifaces] = link_of(le16(r->buf));
+			r->iface_ts_div[r->ifaces++] =
+				idb_ts_div(r->buf + 8, (long) len - 20);
+			break;
+		case PCAPNG_EPB:
+			id = le32(r->buf);
+			caplen = le32(r->buf + 12);
+			if (id >= r->ifaces || r->iface_link[id] < 0
+				|| caplen > len - 28)
+				break;
+			r->link = r->iface_link[id];
+			r->ts_us = ((uint64_t) le32(r->buf + 4) << 32
+				| le32(r->buf + 8)) / r->iface_ts_div[id];
+			memmove(r->buf, r->buf + 20, caplen);
+			return caplen;
+		case PCAPNG_SPB:
+			caplen = le32(r->buf);
+			if (caplen > len - 16)
+				caplen = len - 16;
+			if (r->ifaces == 0 || r->iface_link[0] < 0)
+				break;
+			/* simple packets carry no timestamp */
+			r->link = r->iface_link[0];
+			r->ts_us = 0;
+			memmove(r->buf, r->buf + 4, caplen);
+			return caplen;
+		}
+	}
+}
+
+static int parse_linux(struct usbmon_reader *r, struct usbmon_event *ev,
+	long len)
+{
+	int mmapped = r->link == USBMON_LINK_LINUX_MMAPPED;
+	long hdr_len = mmapped ? 64 : 48;
+	const uint8_t *p = r->buf;
+	uint32_t i;
+
+	if (len < hdr_len)
+		return 0;
+
+	ev->id = le64(p);
+	ev->type = p[8];
+	ev->xfer_type = p[9];
+	ev->ep = p[10];
+	ev->devnum = p[11];
+	ev->busnum = le16(p + 12);
+	ev->ts_us = le64(p + 16) * 1000000 + le32(p + 24);
+	ev->status = le32(p + 28);
+	ev->urb_len = le32(p + 32);
+	ev->ndesc = 0;
+
+	p += hdr_len;
+	len -= hdr_len;
+
+	if (mmapped && ev->xfer_type == USBMON_ISO) {
+		ev->ndesc = le32(r->buf + 60);
+		if (ev->ndesc > USBMON_MAX_ISO_DESC || ev->ndesc * 16 > len)
+			ev->ndesc = 0;
+		for (i = 0; i < ev->ndesc; i++, p += 16, len -= 16) {
+			ev->desc[i].status = le32(p);
+			ev->desc[i].offset = le32(p + 4);
+			ev->desc[i].len = le32(p + 8);
+		}
+	}
+
+	ev->data = p;
+	ev->data_len = len;
+	return 1;
+}
+
+/*
+ * USBPcap writes one record when the IRP goes down to the device and one
+ * when it comes back, which map to the usbmon submission and completion.
+ * The iso packet offsets index the data after the header like in usbmon.
+ */
+static int parse_usbpcap(struct usbmon_reader *r, struct usbmon_event *ev,
+	long len)
+{
+	const uint8_t *p = r->buf;
+	const uint8_t *d;
+	long hdr_len;
+	uint32_t i;
+
+	if (len < USBPCAP_HDR_LEN)
+		return 0;
+	hdr_len = le16(p);
+	if (hdr_len < USBPCAP_HDR_LEN || hdr_len > len)
+		return 0;
+
+	ev->id = le64(p + 2);
+	ev->status = le32(p + 10);
+	ev->type = p[16] & USBPCAP_INFO_PDO_TO_FDO ? 'C' : 'S';
+	ev->busnum = le16(p + 17);
+	ev->devnum = le16(p + 19);
+	ev->ep = p[21];
+	ev->xfer_type = p[22];
+	ev->urb_len = le32(p + 23);
+	ev->ts_us = r->ts_us;
+	ev->ndesc = 0;
+
+	if (ev->xfer_type == USBMON_ISO && hdr_len >= USBPCAP_ISO_HDR_LEN) {
+		ev->ndesc = le32(p + 31);
+		if (ev->ndesc > USBMON_MAX_ISO_DESC
+			|| USBPCAP_ISO_HDR_LEN + ev->ndesc * 12 > hdr_len)
+			ev->ndesc = 0;
+		for (i = 0; i < ev->ndesc; i++) {
+			d = p + USBPCAP_ISO_HDR_LEN + 12 * i;
+			ev->desc[i].offset = le32(d);
+			ev->desc[i].len = le32(d + 4);
+			ev->desc[i].status = le32(d + 8);
+		}
+	}
+
+	ev->data = p + hdr_len;
+	ev->data_len = len - hdr_len;
+	return 1;
+}
+
+int usbmon_next(struct usbmon_reader *r, struct usbmon_event *ev)
+{
+	long len;
+	int ret;
+
+	do {
+		len = next_packet(r);
+		if (len <= 0)
+			return len;
+		if (r->link == USBMON_LINK_USBPCAP)
+			ret = parse_usbpcap(r, ev, len);
+		else
+			ret = parse_linux(r, ev, len);
+	} while (!ret);
+
+	r->records++;
+	return 1;
+}
+
+void usbmon_close(struct usbmon_reader *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+	r->buf_size = 0;
+}
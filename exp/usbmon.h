@@ -0,0 +1,74 @@
+/*
+ * Streaming reader of USB captures saved by Wireshark or tcpdump, both pcap
+ * and pcapng, taken by usbmon on Linux or by USBPcap on Windows. Only one
+ * record is kept in memory at a time.
+ */
+#ifndef USBMON_H
+#define USBMON_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+	USBMON_ISO = 0,
+	USBMON_INTR = 1,
+	USBMON_CTRL = 2,
+	USBMON_BULK = 3
+};
+
+/* the link types understood */
+enum {
+	USBMON_LINK_NONE = -1,
+	USBMON_LINK_LINUX, /* 48 B headers without iso descriptors */
+	USBMON_LINK_LINUX_MMAPPED, /* 64 B headers with iso descriptors */
+	USBMON_LINK_USBPCAP
+};
+
+struct usbmon_iso_desc {
+	int32_t status;
+	uint32_t offset;
+	uint32_t len;
+};
+
+#define USBMON_MAX_ISO_DESC 128
+#define USBMON_MAX_IFACES 16
+
+struct usbmon_event {
+	uint64_t id; /* URB tag, equal for submission and completion */
+	uint64_t ts_us; /* capture time in us */
+	char type; /* 'S'ubmission, 'C'ompletion or 'E'rror */
+	uint8_t xfer_type;
+	uint8_t ep; /* with the direction bit 0x80 */
+	uint8_t devnum;
+	uint16_t busnum;
+	int32_t status;
+	uint32_t urb_len;
+	uint32_t ndesc; /* iso descriptors in desc */
+	struct usbmon_iso_desc desc[USBMON_MAX_ISO_DESC];
+	const uint8_t *data; /* the data after the descriptors */
+	uint32_t data_len;
+};
+
+struct usbmon_reader {
+	FILE *f;
+	int pcapng;
+	int link; /* of the current record */
+	uint32_t ts_div; /* pcap timestamp units per us */
+	int iface_link[USBMON_MAX_IFACES]; /* of the pcapng interfaces */
+	uint32_t iface_ts_div[USBMON_MAX_IFACES];
+	unsigned int ifaces;
+	uint64_t ts_us; /* of the current record */
+	uint8_t *buf;
+	size_t buf_size;
+	uint64_t records;
+};
+
+/* Returns 0 on success, -1 when the file is not a USB capture. */
+int usbmon_open(struct usbmon_reader *r, FILE *f);
+
+/* Returns 1 when ev was filled, 0 at the end of the file, -1 on error. */
+int usbmon_next(struct usbmon_reader *r, struct usbmon_event *ev);
+
+void usbmon_close(struct usbmon_reader *r);
+
+#endif